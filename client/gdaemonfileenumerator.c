@@ -51,8 +51,9 @@ struct _GDaemonFileEnumerator
   GVfsDBusEnumerator *skeleton;
 
   /* protected by infos lock */
-  GList *infos;
+  GQueue infos;
   gboolean done;
+  GError *error; /* Reported once all infos are consumed */
 
   /* For async ops, also protected by infos lock */
   int async_requested_files;
@@ -141,7 +142,8 @@ g_daemon_file_enumerator_finalize (GObject *object)
       g_object_unref (daemon->skeleton);
     }
 
-  free_info_list (daemon->infos);
+  free_info_list (daemon->infos.head);
+  g_clear_error (&daemon->error);
 
   g_file_attribute_matcher_unref (daemon->matcher);
   if (daemon->metadata_tree)
@@ -186,7 +188,7 @@ static void
 next_files_sync_check (GDaemonFileEnumerator *enumerator)
 {
   g_mutex_lock (&enumerator->next_files_mutex);
-  if ((enumerator->infos || enumerator->done) && 
+  if ((enumerator->infos.head || enumerator->done) && 
       enumerator->next_files_mainloop != NULL)
     {
       g_main_loop_quit (enumerator->next_files_mainloop);
@@ -213,6 +215,32 @@ handle_done (GVfsDBusEnumerator *object,
   return TRUE;
 }
 
+static gboolean
+handle_failed (GVfsDBusEnumerator *object,
+               GDBusMethodInvocation *invocation,
+               const gchar *arg_error_domain,
+               gint arg_error_code,
+               const gchar *arg_error_message,
+               gpointer user_data)
+{
+  GDaemonFileEnumerator *enumerator = G_DAEMON_FILE_ENUMERATOR (user_data);
+
+  G_LOCK (infos);
+  g_clear_error (&enumerator->error);
+  enumerator->error = g_error_new_literal (g_quark_from_string (arg_error_domain),
+                                           arg_error_code,
+                                           arg_error_message);
+  enumerator->done = TRUE;
+  next_files_sync_check (enumerator);
+  G_UNLOCK (infos);
+
+  g_signal_emit (enumerator, signals[CHANGED], 0);
+
+  gvfs_dbus_enumerator_complete_failed (object, invocation);
+
+  return TRUE;
+}
+
 static gboolean
 handle_got_info (GVfsDBusEnumerator *object,
                  GDBusMethodInvocation *invocation,
@@ -220,13 +248,11 @@ handle_got_info (GVfsDBusEnumerator *object,
                  gpointer user_data)
 {
   GDaemonFileEnumerator *enumerator = G_DAEMON_FILE_ENUMERATOR (user_data);
-  GList *infos;
+  GQueue infos = G_QUEUE_INIT;
   GFileInfo *info;
   GVariantIter iter;
   GVariant *child;
 
-  infos = NULL;
-    
   g_variant_iter_init (&iter, arg_infos);
   while ((child = g_variant_iter_next_value (&iter)))
     {
@@ -235,15 +261,16 @@ handle_got_info (GVfsDBusEnumerator *object,
         g_assert (G_IS_FILE_INFO (info));
 
       if (info)
-        infos = g_list_prepend (infos, info);
+        g_queue_push_tail (&infos, info);
 
       g_variant_unref (child);
     }
   
-  infos = g_list_reverse (infos);
-  
   G_LOCK (infos);
-  enumerator->infos = g_list_concat (enumerator->infos, infos);
+  /* Append without walking the infos that are already queued, large
+   * directories arrive in many batches */
+  while (!g_queue_is_empty (&infos))
+    g_queue_push_tail_link (&enumerator->infos, g_queue_pop_head_link (&infos));
   next_files_sync_check (enumerator);
   G_UNLOCK (infos);
 
@@ -267,6 +294,7 @@ create_skeleton (GDaemonFileEnumerator *daemon,
 
   skeleton = gvfs_dbus_enumerator_skeleton_new ();
   g_signal_connect (skeleton, "handle-done", G_CALLBACK (handle_done), daemon);
+  g_signal_connect (skeleton, "handle-failed", G_CALLBACK (handle_failed), daemon);
   g_signal_connect (skeleton, "handle-got-info", G_CALLBACK (handle_got_info), daemon);
 
   error = NULL;
@@ -388,6 +416,29 @@ _g_task_return_pointer_idle_cb (GTask *task)
   return FALSE;
 }
 
+static gboolean
+_g_task_return_error_idle_cb (GTask *task)
+{
+  GError *error;
+
+  error = g_object_steal_data (G_OBJECT (task), "_g_task_return_error_idle_error");
+  g_task_return_error (task, error);
+
+  return FALSE;
+}
+
+static void
+_g_task_return_error_idle (GTask *task, GError *error)
+{
+  GSource *source;
+
+  g_object_set_data (G_OBJECT (task), "_g_task_return_error_idle_error", error);
+
+  source = g_idle_source_new ();
+  g_task_attach_source (task, source, (GSourceFunc) _g_task_return_error_idle_cb);
+  g_source_unref (source);
+}
+
 static void
 _g_task_return_pointer_idle (GTask *task, gpointer result, GDestroyNotify notify)
 {
@@ -406,7 +457,7 @@ static void
 trigger_async_done (GTask *task, gboolean ok)
 {
   GDaemonFileEnumerator *daemon = G_DAEMON_FILE_ENUMERATOR (g_task_get_source_object (task));
-  GList *rest, *l = NULL;
+  GList *l = NULL;
 
   if (daemon->cancelled_tag != 0)
     {
@@ -442,21 +493,25 @@ trigger_async_done (GTask *task, gboolean ok)
 
   if (ok)
     {
-      l = daemon->infos;
-      rest = g_list_nth (l, daemon->async_requested_files);
-      if (rest)
-	{
-	  /* Split list */
-	  rest->prev->next = NULL;
-	  rest->prev = NULL;
-	}
-      daemon->infos = rest;
+      GQueue files = G_QUEUE_INIT;
+
+      while (files.length < (guint) daemon->async_requested_files &&
+             !g_queue_is_empty (&daemon->infos))
+        g_queue_push_tail_link (&files, g_queue_pop_head_link (&daemon->infos));
+      l = files.head;
 
       g_list_foreach (l, (GFunc)add_metadata, daemon);
     }
 
   /* Result has to be returned in idle in order to avoid deadlock */
-  _g_task_return_pointer_idle (task, l, (GDestroyNotify) free_info_list);
+  if (ok && l == NULL && daemon->error != NULL)
+    {
+      /* The listing ended early, report it after the last info */
+      _g_task_return_error_idle (task, daemon->error);
+      daemon->error = NULL;
+    }
+  else
+    _g_task_return_pointer_idle (task, l, (GDestroyNotify) free_info_list);
 
   g_signal_handlers_disconnect_by_data (daemon, task);
   daemon->cancelled_tag = 0;
@@ -516,7 +571,7 @@ g_daemon_file_enumerator_next_file (GFileEnumerator *enumerator,
       return NULL;
     }
 
-  if (! daemon->infos && ! daemon->done)
+  if (! daemon->infos.head && ! daemon->done)
     {
       /* Wait for incoming data */
       g_mutex_lock (&daemon->next_files_mutex);
@@ -543,15 +598,20 @@ g_daemon_file_enumerator_next_file (GFileEnumerator *enumerator,
   info = NULL;
 
   G_LOCK (infos);
-  if (daemon->infos)
+  if (daemon->infos.head)
     {
-      info = daemon->infos->data;
+      info = g_queue_pop_head (&daemon->infos);
       if (info)
         {
           g_assert (G_IS_FILE_INFO (info));
           add_metadata (G_FILE_INFO (info), daemon);
         }
-      daemon->infos = g_list_delete_link (daemon->infos, daemon->infos);
+    }
+  else if (daemon->error)
+    {
+      /* The listing ended early, report it after the last info */
+      g_propagate_error (error, daemon->error);
+      daemon->error = NULL;
     }
   G_UNLOCK (infos);
 
@@ -567,7 +627,7 @@ async_changed (GTask *task)
   GDaemonFileEnumerator *enumerator = G_DAEMON_FILE_ENUMERATOR (g_task_get_source_object (task));
 
   G_LOCK (infos);
-  if (enumerator->done || g_list_length (enumerator->infos) >= enumerator->async_requested_files)
+  if (enumerator->done || enumerator->infos.length >= enumerator->async_requested_files)
     trigger_async_done (task, TRUE);
   G_UNLOCK (infos);
 }
@@ -626,7 +686,7 @@ g_daemon_file_enumerator_next_files_async (GFileEnumerator     *enumerator,
 
   /* Maybe we already have enough info to fulfill the requeust already */
   if (daemon->done ||
-      g_list_length (daemon->infos) >= daemon->async_requested_files)
+      daemon->infos.length >= daemon->async_requested_files)
     trigger_async_done (task, TRUE);
   else
     {
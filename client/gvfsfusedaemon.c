@@ -56,12 +56,30 @@ typedef struct {
   GFile *root;
 } MountRecord;
 
+/* Limits the number of operations in flight on a single mount */
+typedef struct {
+  gint      refcount;
+  gchar    *name;
+  guint     active;
+  GCond     cond;
+} MountGate;
+
 typedef enum {
   FILE_OP_NONE,
   FILE_OP_READ,
   FILE_OP_WRITE
 } FileOp;
 
+/* A cached part of a file being read */
+typedef struct {
+  GList     link;         /* In the file's read_blocks_lru */
+  GList     global_link;  /* In read_cache_lru */
+  gpointer  fh;
+  gint64    index;
+  gsize     length;
+  gchar    *data;
+} ReadBlock;
+
 typedef struct {
   gint      refcount;
 
@@ -71,6 +89,16 @@ typedef struct {
   gpointer  stream;
   goffset   pos;
   goffset   size;
+
+  /* Blocks read from the input stream, most recently used first */
+  GHashTable *read_blocks;
+  GQueue      read_blocks_lru;
+
+  /* Data written but not yet passed to the output stream, continues at pos */
+  GByteArray *write_buffer;
+
+  /* Failure to pass buffered data on, reported until the stream is closed */
+  gint        write_error;
 } FileHandle;
 
 static GThread        *subthread             = NULL;
@@ -91,6 +119,21 @@ static GMutex          global_mutex          = {NULL};
 static GHashTable     *global_path_to_fh_map = NULL;
 static GHashTable     *global_active_fh_map  = NULL;
 
+/* Contains pointers to MountGate, keyed by mount name */
+static GMutex          mount_gate_mutex      = {NULL};
+static GHashTable     *mount_gates           = NULL;
+static guint           mount_gate_max_ops;
+
+static guint           read_cache_max_blocks;
+static guint           read_cache_max_total_blocks;
+
+/* Contains the cached ReadBlocks of all open files, most recently used first */
+static GMutex          read_cache_mutex      = {NULL};
+static GQueue          read_cache_lru        = G_QUEUE_INIT;
+static guint           read_cache_total_blocks = 0;
+
+static gsize           write_buffer_max_size;
+
 static GDBusConnection *dbus_conn            = NULL;
 static guint            daemon_name_watcher;
 
@@ -193,6 +236,199 @@ set_pid_for_file (GFile *file)
   ;
 }
 
+/* Reads are done in blocks of this size and kept around, so that small
+ * sequential reads don't each go to the backend and repeated or backward
+ * reads don't restart the stream. */
+#define READ_BLOCK_SIZE                (128 * 1024)
+#define READ_CACHE_DEFAULT_SIZE        4096  /* KiB per open file */
+#define READ_CACHE_DEFAULT_TOTAL_SIZE  65536 /* KiB for all open files */
+
+static void
+read_cache_init (void)
+{
+  const gchar *env;
+  gint64       size;
+
+  size = READ_CACHE_DEFAULT_SIZE;
+  env = g_getenv ("GVFS_FUSE_READ_CACHE_SIZE");
+  if (env)
+    size = MAX (g_ascii_strtoll (env, NULL, 10), 0);
+
+  read_cache_max_blocks = size * 1024 / READ_BLOCK_SIZE;
+
+  size = READ_CACHE_DEFAULT_TOTAL_SIZE;
+  env = g_getenv ("GVFS_FUSE_READ_CACHE_TOTAL_SIZE");
+  if (env)
+    size = MAX (g_ascii_strtoll (env, NULL, 10), 0);
+
+  read_cache_max_total_blocks = size * 1024 / READ_BLOCK_SIZE;
+  if (read_cache_max_total_blocks == 0)
+    read_cache_max_blocks = 0;
+}
+
+static void
+read_block_free (ReadBlock *block)
+{
+  g_free (block->data);
+  g_free (block);
+}
+
+/* Called with fh->mutex and read_cache_mutex held */
+static void
+read_cache_remove_locked (FileHandle *fh, ReadBlock *block)
+{
+  g_queue_unlink (&read_cache_lru, &block->global_link);
+  read_cache_total_blocks--;
+
+  g_queue_unlink (&fh->read_blocks_lru, &block->link);
+  g_hash_table_remove (fh->read_blocks, &block->index);
+}
+
+static ReadBlock *
+read_cache_lookup (FileHandle *fh, gint64 index)
+{
+  ReadBlock *block;
+
+  if (fh->read_blocks == NULL)
+    return NULL;
+
+  block = g_hash_table_lookup (fh->read_blocks, &index);
+  if (block)
+    {
+      g_queue_unlink (&fh->read_blocks_lru, &block->link);
+      g_queue_push_head_link (&fh->read_blocks_lru, &block->link);
+
+      g_mutex_lock (&read_cache_mutex);
+      g_queue_unlink (&read_cache_lru, &block->global_link);
+      g_queue_push_head_link (&read_cache_lru, &block->global_link);
+      g_mutex_unlock (&read_cache_mutex);
+    }
+
+  return block;
+}
+
+/* Called with fh->mutex held. Once all open files together reach the
+ * total limit, the least recently used blocks of any file are dropped.
+ * The lock order is file first, so the blocks of a file that is busy in
+ * another thread are skipped and the total may be exceeded until it is
+ * used again. */
+static void
+read_cache_insert (FileHandle *fh, ReadBlock *block)
+{
+  GList *link, *prev;
+
+  if (fh->read_blocks == NULL)
+    fh->read_blocks = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+                                             NULL, (GDestroyNotify) read_block_free);
+
+  g_mutex_lock (&read_cache_mutex);
+
+  while (g_hash_table_size (fh->read_blocks) > 0 &&
+         g_hash_table_size (fh->read_blocks) >= read_cache_max_blocks)
+    read_cache_remove_locked (fh, g_queue_peek_tail (&fh->read_blocks_lru));
+
+  for (link = read_cache_lru.tail;
+       link != NULL && read_cache_total_blocks >= read_cache_max_total_blocks;
+       link = prev)
+    {
+      ReadBlock  *oldest = link->data;
+      FileHandle *owner = oldest->fh;
+
+      prev = link->prev;
+
+      if (owner == fh)
+        read_cache_remove_locked (owner, oldest);
+      else if (g_mutex_trylock (&owner->mutex))
+        {
+          read_cache_remove_locked (owner, oldest);
+          g_mutex_unlock (&owner->mutex);
+        }
+    }
+
+  block->fh = fh;
+  block->link.data = block;
+  block->global_link.data = block;
+  g_queue_push_head_link (&fh->read_blocks_lru, &block->link);
+  g_queue_push_head_link (&read_cache_lru, &block->global_link);
+  g_hash_table_insert (fh->read_blocks, &block->index, block);
+  read_cache_total_blocks++;
+
+  g_mutex_unlock (&read_cache_mutex);
+}
+
+static void
+read_cache_clear (FileHandle *fh)
+{
+  GList *link;
+
+  if (fh->read_blocks == NULL)
+    return;
+
+  g_mutex_lock (&read_cache_mutex);
+  for (link = fh->read_blocks_lru.head; link != NULL; link = link->next)
+    {
+      ReadBlock *block = link->data;
+
+      g_queue_unlink (&read_cache_lru, &block->global_link);
+      read_cache_total_blocks--;
+    }
+  g_mutex_unlock (&read_cache_mutex);
+
+  g_clear_pointer (&fh->read_blocks, g_hash_table_destroy);
+  g_queue_init (&fh->read_blocks_lru);
+}
+
+/* Small sequential writes are collected up to this size and passed to the
+ * backend at once. */
+#define WRITE_BUFFER_DEFAULT_SIZE      1024  /* KiB */
+
+static void
+write_buffer_init (void)
+{
+  const gchar *env;
+  gint64       size;
+
+  size = WRITE_BUFFER_DEFAULT_SIZE;
+  env = g_getenv ("GVFS_FUSE_WRITE_BUFFER_SIZE");
+  if (env)
+    size = MAX (g_ascii_strtoll (env, NULL, 10), 0);
+
+  write_buffer_max_size = size * 1024;
+}
+
+/* Call with fh locked */
+static gint
+file_handle_flush_writes (FileHandle *fh)
+{
+  GError *error         = NULL;
+  gsize   bytes_written = 0;
+  gint    result        = 0;
+
+  if (fh->op != FILE_OP_WRITE || fh->write_buffer == NULL || fh->write_buffer->len == 0)
+    return 0;
+
+  g_debug ("file_handle_flush_writes: %u bytes at offset %" G_GINT64_FORMAT ".\n",
+           fh->write_buffer->len, fh->pos);
+
+  if (!g_output_stream_write_all (fh->stream,
+                                  fh->write_buffer->data, fh->write_buffer->len,
+                                  &bytes_written, NULL, &error) ||
+      !g_output_stream_flush (fh->stream, NULL, &error))
+    {
+      result = -errno_from_error (error);
+      g_error_free (error);
+
+      /* Callers such as getattr can't report it, keep it for the writer */
+      if (fh->write_error == 0)
+        fh->write_error = result;
+    }
+
+  fh->pos += bytes_written;
+  g_byte_array_set_size (fh->write_buffer, 0);
+
+  return result;
+}
+
 static FileHandle *
 file_handle_new (const gchar *path)
 {
@@ -252,6 +488,7 @@ file_handle_close_stream (FileHandle *file_handle)
           break;
           
         case FILE_OP_WRITE:
+          file_handle_flush_writes (file_handle);
           g_output_stream_close (file_handle->stream, NULL, NULL);
           break;
           
@@ -264,6 +501,10 @@ file_handle_close_stream (FileHandle *file_handle)
       file_handle->op = FILE_OP_NONE;
       file_handle->size = -1;
     }
+
+  read_cache_clear (file_handle);
+  g_clear_pointer (&file_handle->write_buffer, g_byte_array_unref);
+  file_handle->write_error = 0;
 }
 
 /* Called on hash table removal */
@@ -294,6 +535,18 @@ get_file_handle_for_path (const gchar *path)
   return fh;
 }
 
+static gboolean
+have_file_handle_for_path (const gchar *path)
+{
+  gboolean found;
+
+  g_mutex_lock (&global_mutex);
+  found = g_hash_table_contains (global_path_to_fh_map, path);
+  g_mutex_unlock (&global_mutex);
+
+  return found;
+}
+
 static FileHandle *
 get_or_create_file_handle_for_path (const gchar *path)
 {
@@ -463,6 +716,154 @@ mount_record_find_root_by_mount_name (const gchar *mount_name)
   return root;
 }
 
+#define MOUNT_GATE_DEFAULT_MAX_OPS  8
+
+static void
+mount_gate_init (void)
+{
+  const gchar *env;
+
+  mount_gate_max_ops = MOUNT_GATE_DEFAULT_MAX_OPS;
+  env = g_getenv ("GVFS_FUSE_MAX_OPS_PER_MOUNT");
+  if (env)
+    mount_gate_max_ops = MAX (g_ascii_strtoll (env, NULL, 10), 0);
+
+  mount_gates = g_hash_table_new (g_str_hash, g_str_equal);
+}
+
+/* Returns the mount a path is on, NULL for the mount list itself */
+static gchar *
+mount_name_from_path (const gchar *path)
+{
+  const gchar *s1, *s2;
+
+  s1 = path;
+  while (*s1 == '/')
+    s1++;
+
+  if (*s1 == 0)
+    return NULL;
+
+  s2 = strchr (s1, '/');
+  if (s2 == NULL)
+    s2 = s1 + strlen (s1);
+
+  return g_strndup (s1, s2 - s1);
+}
+
+static void
+mount_gate_unref_locked (MountGate *gate)
+{
+  if (--gate->refcount == 0)
+    {
+      g_hash_table_remove (mount_gates, gate->name);
+      g_cond_clear (&gate->cond);
+      g_free (gate->name);
+      g_free (gate);
+    }
+}
+
+/* Waits until an operation may be started on the mount. There is no
+ * timeout: a read or stat on a slow mount should take longer, not fail. A
+ * stalled backend only holds up the operations on its own mount. */
+static MountGate *
+mount_gate_enter_by_name (const gchar *mount_name)
+{
+  MountGate *gate;
+
+  g_mutex_lock (&mount_gate_mutex);
+
+  gate = g_hash_table_lookup (mount_gates, mount_name);
+  if (gate == NULL)
+    {
+      gate = g_new0 (MountGate, 1);
+      gate->name = g_strdup (mount_name);
+      g_cond_init (&gate->cond);
+      g_hash_table_insert (mount_gates, gate->name, gate);
+    }
+  gate->refcount++;
+
+  while (gate->active >= mount_gate_max_ops)
+    g_cond_wait (&gate->cond, &mount_gate_mutex);
+  gate->active++;
+
+  g_mutex_unlock (&mount_gate_mutex);
+
+  return gate;
+}
+
+static void
+mount_gate_leave (MountGate *gate)
+{
+  if (gate == NULL)
+    return;
+
+  g_mutex_lock (&mount_gate_mutex);
+
+  gate->active--;
+  g_cond_signal (&gate->cond);
+  mount_gate_unref_locked (gate);
+
+  g_mutex_unlock (&mount_gate_mutex);
+}
+
+/* Takes a slot on the mount of the path for the duration of an
+ * operation. The gate is left NULL if there is nothing to limit. */
+static void
+mount_gate_enter (const gchar *path, MountGate **gate)
+{
+  gchar *mount_name;
+
+  *gate = NULL;
+
+  if (mount_gate_max_ops == 0)
+    return;
+
+  mount_name = mount_name_from_path (path);
+  if (mount_name)
+    *gate = mount_gate_enter_by_name (mount_name);
+  g_free (mount_name);
+}
+
+/* Same as mount_gate_enter () for operations on two paths. Paths on the
+ * same mount share a single slot, and the slots on two different mounts
+ * are always taken in the same order, so that two such operations can't
+ * wait on each other. */
+static void
+mount_gate_enter_pair (const gchar *path1, const gchar *path2,
+                       MountGate **gate1, MountGate **gate2)
+{
+  gchar *name1, *name2;
+
+  *gate1 = NULL;
+  *gate2 = NULL;
+
+  if (mount_gate_max_ops == 0)
+    return;
+
+  name1 = mount_name_from_path (path1);
+  name2 = mount_name_from_path (path2);
+
+  if (name1 == NULL || name2 == NULL || strcmp (name1, name2) == 0)
+    {
+      if (name1 || name2)
+        *gate1 = mount_gate_enter_by_name (name1 ? name1 : name2);
+    }
+  else if (strcmp (name1, name2) < 0)
+    {
+      *gate1 = mount_gate_enter_by_name (name1);
+      *gate2 = mount_gate_enter_by_name (name2);
+    }
+  else
+    {
+      *gate2 = mount_gate_enter_by_name (name2);
+      *gate1 = mount_gate_enter_by_name (name1);
+    }
+
+  g_free (name1);
+  g_free (name2);
+}
+
 static void
 mount_list_update (void)
 {
@@ -608,6 +1009,193 @@ file_from_full_path (const gchar *path)
   return file;
 }
 
+/* ---------- *
+ * Stat cache *
+ * ---------- */
+
+/* Every getattr otherwise turns into a backend round trip, and tools like
+ * ls or find stat each entry right after reading the directory. Results,
+ * including ENOENT, are kept for a short while; our own modifications drop
+ * the affected entries, changes made by other clients are visible once the
+ * entry expires. */
+
+#define STAT_CACHE_DEFAULT_TTL          2     /* seconds */
+#define STAT_CACHE_DEFAULT_MAX_ENTRIES  16384
+
+typedef struct {
+  struct stat sbuf;
+  gint        result;
+  gint64      expires;
+} StatCacheEntry;
+
+static GMutex          stat_cache_mutex      = {NULL};
+static GHashTable     *stat_cache            = NULL;
+static guint           stat_cache_generation = 0;
+static gint64          stat_cache_ttl;
+static guint           stat_cache_max_entries;
+
+/* In seconds */
+static gint64
+stat_cache_get_ttl (void)
+{
+  const gchar *env;
+
+  env = g_getenv ("GVFS_FUSE_ATTR_CACHE_TTL");
+  if (env)
+    return MAX (g_ascii_strtoll (env, NULL, 10), 0);
+
+  return STAT_CACHE_DEFAULT_TTL;
+}
+
+static void
+stat_cache_init (void)
+{
+  const gchar *env;
+
+  stat_cache_ttl = stat_cache_get_ttl () * G_USEC_PER_SEC;
+
+  stat_cache_max_entries = STAT_CACHE_DEFAULT_MAX_ENTRIES;
+  env = g_getenv ("GVFS_FUSE_ATTR_CACHE_SIZE");
+  if (env)
+    stat_cache_max_entries = MAX (g_ascii_strtoll (env, NULL, 10), 1);
+
+  stat_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+}
+
+/* Returns a value to pass to stat_cache_insert () so that results fetched
+ * while the path was being modified are not cached. */
+static guint
+stat_cache_get_generation (void)
+{
+  guint generation;
+
+  g_mutex_lock (&stat_cache_mutex);
+  generation = stat_cache_generation;
+  g_mutex_unlock (&stat_cache_mutex);
+
+  return generation;
+}
+
+static gboolean
+stat_cache_lookup (const gchar *path, struct stat *sbuf, gint *result)
+{
+  StatCacheEntry *entry;
+  gboolean        found = FALSE;
+
+  if (stat_cache_ttl == 0)
+    return FALSE;
+
+  g_mutex_lock (&stat_cache_mutex);
+
+  entry = g_hash_table_lookup (stat_cache, path);
+  if (entry)
+    {
+      if (entry->expires > g_get_monotonic_time ())
+        {
+          *sbuf = entry->sbuf;
+          *result = entry->result;
+          found = TRUE;
+        }
+      else
+        {
+          g_hash_table_remove (stat_cache, path);
+        }
+    }
+
+  g_mutex_unlock (&stat_cache_mutex);
+
+  return found;
+}
+
+static gboolean
+stat_cache_entry_is_expired (gpointer key, gpointer value, gpointer user_data)
+{
+  StatCacheEntry *entry = value;
+
+  return entry->expires <= *(gint64 *) user_data;
+}
+
+/* Only successful results and ENOENT are cached, sbuf may be NULL for
+ * the latter. */
+static void
+stat_cache_insert (const gchar *path, const struct stat *sbuf, gint result,
+                   guint generation)
+{
+  StatCacheEntry *entry;
+  gint64          now;
+
+  if (stat_cache_ttl == 0 || (result != 0 && result != -ENOENT))
+    return;
+
+  g_mutex_lock (&stat_cache_mutex);
+
+  if (generation != stat_cache_generation)
+    {
+      g_mutex_unlock (&stat_cache_mutex);
+      return;
+    }
+
+  now = g_get_monotonic_time ();
+
+  if (g_hash_table_size (stat_cache) >= stat_cache_max_entries)
+    {
+      g_hash_table_foreach_remove (stat_cache, stat_cache_entry_is_expired, &now);
+      if (g_hash_table_size (stat_cache) >= stat_cache_max_entries)
+        g_hash_table_remove_all (stat_cache);
+    }
+
+  entry = g_new0 (StatCacheEntry, 1);
+  if (sbuf)
+    entry->sbuf = *sbuf;
+  entry->result = result;
+  entry->expires = now + stat_cache_ttl;
+
+  g_hash_table_replace (stat_cache, g_strdup (path), entry);
+
+  g_mutex_unlock (&stat_cache_mutex);
+}
+
+static gboolean
+stat_cache_path_is_within (gpointer key, gpointer value, gpointer user_data)
+{
+  const gchar *path = key;
+  const gchar *prefix = user_data;
+  gsize        len = strlen (prefix);
+
+  return strncmp (path, prefix, len) == 0 && (path[len] == '/' || path[len] == 0);
+}
+
+/* Drops the cached attributes of path, and with recursive also those of
+ * everything below it. */
+static void
+stat_cache_invalidate (const gchar *path, gboolean recursive)
+{
+  g_mutex_lock (&stat_cache_mutex);
+
+  stat_cache_generation++;
+
+  if (recursive)
+    g_hash_table_foreach_remove (stat_cache, stat_cache_path_is_within, (gpointer) path);
+  else
+    g_hash_table_remove (stat_cache, path);
+
+  g_mutex_unlock (&stat_cache_mutex);
+}
+
+/* For operations adding or removing path, which also change the size and
+ * times of its parent directory. */
+static void
+stat_cache_invalidate_entry (const gchar *path, gboolean recursive)
+{
+  gchar *parent;
+
+  stat_cache_invalidate (path, recursive);
+
+  parent = g_path_get_dirname (path);
+  stat_cache_invalidate (parent, FALSE);
+  g_free (parent);
+}
+
 /* ------------- *
  * VFS functions *
  * ------------- */
@@ -618,9 +1206,12 @@ vfs_statfs (const gchar *path, struct statvfs *stbuf)
   GFile  *file;
   GError *error  = NULL;
   gint    result = 0;
+  MountGate *gate;
 
   g_debug ("vfs_statfs: %s\n", path);
 
+  mount_gate_enter (path, &gate);
+
   memset (stbuf, 0, sizeof (*stbuf));
 
   /* Fallback case */
@@ -667,6 +1258,8 @@ vfs_statfs (const gchar *path, struct statvfs *stbuf)
       g_object_unref (file);
     }
 
+  mount_gate_leave (gate);
+
   g_debug ("vfs_statfs: -> %s\n", g_strerror (-result));
 
   return result;
@@ -818,6 +1411,8 @@ getattr_for_file_handle (FileHandle *fh, struct stat *sbuf)
                                                   NULL, &error);
       break;
     case FILE_OP_WRITE:
+      /* Let the backend see everything written so far */
+      file_handle_flush_writes (fh);
       file_info = g_file_output_stream_query_info (G_FILE_OUTPUT_STREAM (fh->stream),
                                                   query_attributes,
                                                   NULL, &error);
@@ -853,6 +1448,7 @@ static gint
 vfs_getattr (const gchar *path, struct stat *sbuf)
 {
   GFile      *file;
+  MountGate  *gate = NULL;
   gint        result = 0;
 
   g_debug ("vfs_getattr: %s\n", path);
@@ -883,10 +1479,17 @@ vfs_getattr (const gchar *path, struct stat *sbuf)
       sbuf->st_uid   = daemon_uid;
       sbuf->st_gid   = daemon_gid;
     }
+  else if (!have_file_handle_for_path (path) && stat_cache_lookup (path, sbuf, &result))
+    {
+      /* Cached, no need to wait for the mount */
+    }
   else if ((file = file_from_full_path (path)))
     {
       /* Submount */
-      FileHandle *fh = get_file_handle_for_path (path);
+      FileHandle *fh;
+
+      mount_gate_enter (path, &gate);
+      fh = get_file_handle_for_path (path);
 
       if (fh)
         {
@@ -928,7 +1531,10 @@ vfs_getattr (const gchar *path, struct stat *sbuf)
         }
       else
         {
+          guint generation = stat_cache_get_generation ();
+
           result = getattr_for_file (file, sbuf);
+          stat_cache_insert (path, sbuf, result, generation);
         }
 
       g_object_unref (file);
@@ -938,6 +1544,8 @@ vfs_getattr (const gchar *path, struct stat *sbuf)
       result = -ENOENT;
     }
 
+  mount_gate_leave (gate);
+
   g_debug ("vfs_getattr: -> %s\n", g_strerror (-result));
 
   return result;
@@ -974,10 +1582,12 @@ setup_input_stream (GFile *file, FileHandle *fh)
         {
           g_debug ("setup_input_stream: doing write\n");
 
+          file_handle_flush_writes (fh);
           g_output_stream_close (fh->stream, NULL, NULL);
           g_object_unref (fh->stream);
           fh->stream = NULL;
           fh->size = -1;
+          g_clear_pointer (&fh->write_buffer, g_byte_array_unref);
         }
     }
 
@@ -1019,6 +1629,7 @@ setup_output_stream (GFile *file, FileHandle *fh, int flags)
           g_input_stream_close (fh->stream, NULL, NULL);
           g_object_unref (fh->stream);
           fh->stream = NULL;
+          read_cache_clear (fh);
         }
     }
 
@@ -1028,6 +1639,7 @@ setup_output_stream (GFile *file, FileHandle *fh, int flags)
         {
           fh->stream = g_file_replace (file, NULL, FALSE, 0, NULL, &error);
           fh->size = 0;
+          read_cache_clear (fh);
         }
       else if (flags & O_APPEND)
         fh->stream = g_file_append_to (file, 0, NULL, &error);
@@ -1072,11 +1684,15 @@ open_common (const gchar *path, struct fuse_file_info *fi, GFile *file, int outp
   set_pid_for_file (file);
 
   if (fi->flags & O_WRONLY || fi->flags & O_RDWR)
-    result = setup_output_stream (file, fh, fi->flags | output_flags);
+    {
+      result = setup_output_stream (file, fh, fi->flags | output_flags);
+      stat_cache_invalidate_entry (path, FALSE);
+    }
   else
     result = setup_input_stream (file, fh);
 
-  if (fh->stream)
+  /* Reads at any offset are supported, see seek_input_stream () */
+  if (fh->stream && fh->op == FILE_OP_WRITE)
     fi->nonseekable = !g_seekable_can_seek (G_SEEKABLE (fh->stream));
 
   g_mutex_unlock (&fh->mutex);
@@ -1090,9 +1706,12 @@ vfs_open (const gchar *path, struct fuse_file_info *fi)
 {
   GFile *file;
   gint   result = 0;
+  MountGate *gate;
 
   g_debug ("vfs_open: %s\n", path);
 
+  mount_gate_enter (path, &gate);
+
   if (path_is_mount_list (path))
     result = -EISDIR;
   else if ((file = file_from_full_path (path)))
@@ -1145,6 +1764,8 @@ vfs_open (const gchar *path, struct fuse_file_info *fi)
       result = -ENOENT;
     }
 
+  mount_gate_leave (gate);
+
   g_debug ("vfs_open: -> %s\n", g_strerror (-result));
 
   return result;
@@ -1155,9 +1776,12 @@ vfs_create (const gchar *path, mode_t mode, struct fuse_file_info *fi)
 {
   GFile *file;
   gint   result = 0;
+  MountGate *gate;
 
   g_debug ("vfs_create: %s\n", path);
 
+  mount_gate_enter (path, &gate);
+
   if (path_is_mount_list (path))
     result = -EEXIST;
   if ((file = file_from_full_path (path)))
@@ -1185,6 +1809,7 @@ vfs_create (const gchar *path, mode_t mode, struct fuse_file_info *fi)
             }
 
           file_output_stream = g_file_create (file, 0, NULL, &error);
+          stat_cache_invalidate_entry (path, FALSE);
           if (file_output_stream)
             {
               FileHandle *fh = get_or_create_file_handle_for_path (path);
@@ -1218,6 +1843,8 @@ vfs_create (const gchar *path, mode_t mode, struct fuse_file_info *fi)
       result = -ENOENT;
     }
 
+  mount_gate_leave (gate);
+
   g_debug ("vfs_create: -> %s\n", g_strerror (-result));
 
   return result;
@@ -1236,6 +1863,10 @@ vfs_release (const gchar *path, struct fuse_file_info *fi)
       file_handle_close_stream (fh);
       g_mutex_unlock (&fh->mutex);
 
+      /* Closing a written stream may change the size and times, or only
+       * now create the file on some backends. */
+      stat_cache_invalidate_entry (path, FALSE);
+
       /* get_file_handle_from_info () adds a "working ref", so unref twice. */
       file_handle_unref (fh);
       file_handle_unref (fh);
@@ -1244,105 +1875,247 @@ vfs_release (const gchar *path, struct fuse_file_info *fi)
   return 0;
 }
 
+/* Called on every close (), so errors of buffered writes can be reported */
+static gint
+vfs_flush (const gchar *path, struct fuse_file_info *fi)
+{
+  FileHandle *fh = get_file_handle_from_info (fi);
+  gint        result = 0;
+
+  g_debug ("vfs_flush: %s\n", path);
+
+  if (fh)
+    {
+      g_mutex_lock (&fh->mutex);
+      result = file_handle_flush_writes (fh);
+      if (result == 0)
+        result = fh->write_error;
+      g_mutex_unlock (&fh->mutex);
+
+      file_handle_unref (fh);
+    }
+
+  g_debug ("vfs_flush: -> %s\n", g_strerror (-result));
+
+  return result;
+}
+
 static gint
-read_stream (FileHandle *fh, gchar *output_buf, size_t output_buf_size, off_t offset)
+vfs_fsync (const gchar *path, gint datasync, struct fuse_file_info *fi)
+{
+  g_debug ("vfs_fsync: %s\n", path);
+
+  return vfs_flush (path, fi);
+}
+
+/* Moves the input stream to offset. Streams that can neither seek nor
+ * skip backwards are reopened. Call with fh locked. */
+static gint
+seek_input_stream (GFile *file, FileHandle *fh, off_t offset)
 {
   GInputStream *input_stream;
   gint          n_bytes_skipped = 0;
-  gint          n_bytes_read    = 0;
   gint          result          = 0;
   GError       *error           = NULL;
 
+  if (offset == fh->pos)
+    return 0;
+
   input_stream = fh->stream;
 
-  if (offset != fh->pos)
+  if (g_seekable_can_seek (G_SEEKABLE (input_stream)))
     {
-      if (g_seekable_can_seek (G_SEEKABLE (input_stream)))
-        {
-          /* Can seek */
+      /* Can seek */
 
-          g_debug ("read_stream: seeking to offset %jd.\n", offset);
+      g_debug ("read_stream: seeking to offset %jd.\n", offset);
 
-          if (g_seekable_seek (G_SEEKABLE (input_stream), offset, G_SEEK_SET, NULL, &error))
-            {
-              fh->pos = offset;
-            }
-          else
-            {
-              result = -errno_from_error (error);
-              g_error_free (error);
-            }
+      if (g_seekable_seek (G_SEEKABLE (input_stream), offset, G_SEEK_SET, NULL, &error))
+        {
+          fh->pos = offset;
         }
-      else if (offset > fh->pos)
+      else
         {
-          /* Can skip ahead */
+          result = -errno_from_error (error);
+          g_error_free (error);
+        }
 
-          g_debug ("read_stream: skipping to offset %jd.\n", offset);
+      return result;
+    }
 
-          n_bytes_skipped = g_input_stream_skip (input_stream, offset - fh->pos, NULL, &error);
+  if (offset < fh->pos)
+    {
+      GFileInputStream *file_input_stream;
 
-          if (n_bytes_skipped > 0)
-            fh->pos += n_bytes_skipped;
+      /* Can't seek, can't skip backwards */
 
-          if (offset != fh->pos)
-            {
-              if (error)
-                {
-                  result = -errno_from_error (error);
-                  g_error_free (error);
-                }
-              else
-                {
-                  result = -EIO;
-                }
-            }
+      g_debug ("read_stream: reopening to reach offset %jd.\n", offset);
+
+      file_input_stream = g_file_read (file, NULL, &error);
+      if (file_input_stream == NULL)
+        {
+          result = -errno_from_error (error);
+          g_error_free (error);
+          return result;
+        }
+
+      g_input_stream_close (input_stream, NULL, NULL);
+      g_object_unref (input_stream);
+      fh->stream = input_stream = G_INPUT_STREAM (file_input_stream);
+      fh->pos = 0;
+
+      if (offset == 0)
+        return 0;
+    }
+
+  /* Can skip ahead */
+
+  g_debug ("read_stream: skipping to offset %jd.\n", offset);
+
+  n_bytes_skipped = g_input_stream_skip (input_stream, offset - fh->pos, NULL, &error);
+
+  if (n_bytes_skipped > 0)
+    fh->pos += n_bytes_skipped;
+
+  if (offset != fh->pos)
+    {
+      if (error)
+        {
+          result = -errno_from_error (error);
+          g_error_free (error);
         }
       else
         {
-          /* Can't seek, can't skip backwards */
+          result = -EIO;
+        }
+    }
+  else if (error)
+    {
+      g_error_free (error);
+    }
 
-          g_debug ("read_stream: can't seek nor skip to offset %jd!\n", offset);
+  return result;
+}
 
-          result = -ENOTSUP;
+/* Reads from the current position, short only at the end of the file */
+static gint
+read_input_stream (FileHandle *fh, gchar *output_buf, size_t output_buf_size)
+{
+  GInputStream *input_stream;
+  gint          n_bytes_read    = 0;
+  gint          result          = 0;
+  GError       *error           = NULL;
+
+  input_stream = fh->stream;
+
+  while (n_bytes_read < output_buf_size)
+    {
+      gboolean part_result;
+      gsize    part_bytes_read = 0;
+
+      part_result = g_input_stream_read_all (input_stream,
+                                             output_buf + n_bytes_read,
+                                             output_buf_size - n_bytes_read,
+                                             &part_bytes_read,
+                                             NULL,
+                                             &error);
+
+      n_bytes_read += part_bytes_read;
+      fh->pos += part_bytes_read;
+
+      if (!part_result || part_bytes_read == 0)
+        break;
+    }
+
+  result = n_bytes_read;
+
+  if (n_bytes_read < output_buf_size)
+    {
+      g_debug ("read_stream: wanted %zd bytes, but got %d.\n", output_buf_size, n_bytes_read);
+
+      if (error)
+        {
+          result = -errno_from_error (error);
+          g_error_free (error);
         }
     }
 
+  return result;
+}
+
+static gint
+read_block (GFile *file, FileHandle *fh, gint64 index, ReadBlock **block_out)
+{
+  ReadBlock *block;
+  gint       result;
+
+  block = g_new0 (ReadBlock, 1);
+  block->index = index;
+  block->data = g_malloc (READ_BLOCK_SIZE);
+
+  result = seek_input_stream (file, fh, index * READ_BLOCK_SIZE);
   if (result == 0)
+    result = read_input_stream (fh, block->data, READ_BLOCK_SIZE);
+
+  if (result < 0)
     {
-      while (n_bytes_read < output_buf_size)
-        {
-          gboolean part_result;
-          gsize    part_bytes_read = 0;
+      read_block_free (block);
+      return result;
+    }
 
-          part_result = g_input_stream_read_all (input_stream,
-                                                 output_buf + n_bytes_read,
-                                                 output_buf_size - n_bytes_read,
-                                                 &part_bytes_read,
-                                                 NULL,
-                                                 &error);
+  block->length = result;
+  if (block->length < READ_BLOCK_SIZE)
+    block->data = g_realloc (block->data, block->length);
 
-          n_bytes_read += part_bytes_read;
-          fh->pos += part_bytes_read;
+  read_cache_insert (fh, block);
+  *block_out = block;
 
-          if (!part_result || part_bytes_read == 0)
-            break;
-        }
+  return 0;
+}
 
-      result = n_bytes_read;
+static gint
+read_stream (GFile *file, FileHandle *fh, gchar *output_buf, size_t output_buf_size, off_t offset)
+{
+  gint n_bytes_read = 0;
+  gint result;
 
-      if (n_bytes_read < output_buf_size)
-        {
-          g_debug ("read_stream: wanted %zd bytes, but got %d.\n", output_buf_size, n_bytes_read);
+  if (read_cache_max_blocks == 0)
+    {
+      result = seek_input_stream (file, fh, offset);
+      if (result == 0)
+        result = read_input_stream (fh, output_buf, output_buf_size);
 
-          if (error)
-            {
-              result = -errno_from_error (error);
-              g_error_free (error);
-            }
+      return result;
+    }
+
+  while (n_bytes_read < output_buf_size)
+    {
+      off_t      pos = offset + n_bytes_read;
+      gint64     index = pos / READ_BLOCK_SIZE;
+      gsize      block_offset = pos % READ_BLOCK_SIZE;
+      gsize      len;
+      ReadBlock *block;
+
+      block = read_cache_lookup (fh, index);
+      if (block == NULL)
+        {
+          result = read_block (file, fh, index, &block);
+          if (result < 0)
+            return n_bytes_read > 0 ? n_bytes_read : result;
         }
+
+      if (block_offset >= block->length)
+        break;
+
+      len = MIN (block->length - block_offset, output_buf_size - n_bytes_read);
+      memcpy (output_buf + n_bytes_read, block->data + block_offset, len);
+      n_bytes_read += len;
+
+      /* A short block is the end of the file */
+      if (block->length < READ_BLOCK_SIZE)
+        break;
     }
 
-  return result;
+  return n_bytes_read;
 }
 
 static gint
@@ -1351,9 +2124,12 @@ vfs_read (const gchar *path, gchar *buf, size_t size,
 {
   GFile *file;
   gint   result = 0;
+  MountGate *gate;
 
   g_debug ("vfs_read: %s\n", path);
 
+  mount_gate_enter (path, &gate);
+
   if ((file = file_from_full_path (path)))
     {
       FileHandle *fh = get_file_handle_from_info (fi);
@@ -1366,7 +2142,7 @@ vfs_read (const gchar *path, gchar *buf, size_t size,
 
           if (result == 0)
             {
-              result = read_stream (fh, buf, size, offset);
+              result = read_stream (file, fh, buf, size, offset);
             }
           else
             {
@@ -1388,6 +2164,8 @@ vfs_read (const gchar *path, gchar *buf, size_t size,
       result = -EIO;
     }
 
+  mount_gate_leave (gate);
+
   if (result < 0)
     g_debug ("vfs_read: -> %s\n", g_strerror (-result));
   else
@@ -1397,18 +2175,18 @@ vfs_read (const gchar *path, gchar *buf, size_t size,
 }
 
 static gint
-write_stream (FileHandle *fh,
-              gboolean is_append,
-              const gchar *input_buf,
-              size_t input_buf_size,
-              off_t offset)
+write_output_stream (FileHandle *fh,
+                     gboolean is_append,
+                     const gchar *input_buf,
+                     size_t input_buf_size,
+                     off_t offset)
 {
   GOutputStream *output_stream;
   gint           n_bytes_written = 0;
   gint           result          = 0;
   GError        *error           = NULL;
 
-  g_debug ("write_stream: %zd bytes at offset %ju.\n", input_buf_size, offset);
+  g_debug ("write_output_stream: %zd bytes at offset %ju.\n", input_buf_size, offset);
 
   output_stream = fh->stream;
 
@@ -1480,12 +2258,53 @@ write_stream (FileHandle *fh,
   return result;
 }
 
+/* Collects sequential writes, anything else goes to the stream directly */
+static gint
+write_stream (FileHandle *fh,
+              gboolean is_append,
+              const gchar *input_buf,
+              size_t input_buf_size,
+              off_t offset)
+{
+  gsize pending;
+  gint  result;
+
+  pending = fh->write_buffer ? fh->write_buffer->len : 0;
+
+  if (pending > 0 &&
+      ((!is_append && offset != fh->pos + pending) ||
+       pending + input_buf_size > write_buffer_max_size))
+    {
+      result = file_handle_flush_writes (fh);
+      if (result < 0)
+        return result;
+
+      pending = 0;
+    }
+
+  if (input_buf_size >= write_buffer_max_size ||
+      (pending == 0 && !is_append && offset != fh->pos))
+    return write_output_stream (fh, is_append, input_buf, input_buf_size, offset);
+
+  g_debug ("write_stream: buffering %zd bytes at offset %ju.\n", input_buf_size, offset);
+
+  if (fh->write_buffer == NULL)
+    fh->write_buffer = g_byte_array_sized_new (write_buffer_max_size);
+  g_byte_array_append (fh->write_buffer, (const guint8 *) input_buf, input_buf_size);
+
+  if (fh->size != -1 && fh->pos + fh->write_buffer->len > fh->size)
+    fh->size = fh->pos + fh->write_buffer->len;
+
+  return input_buf_size;
+}
+
 static gint
 vfs_write (const gchar *path, const gchar *buf, size_t len, off_t offset,
            struct fuse_file_info *fi)
 {
   GFile *file;
   gint   result = 0;
+  MountGate *gate;
 
   g_debug ("vfs_write: %s\n", path);
   g_debug ("vfs_write: flags=%o (%s%s%s%s)\n",
@@ -1495,6 +2314,8 @@ vfs_write (const gchar *path, const gchar *buf, size_t len, off_t offset,
            fi->flags & O_APPEND ? "O_APPEND " : "",
            fi->flags & O_TRUNC  ? "O_TRUNC "  : "");
 
+  mount_gate_enter (path, &gate);
+
   if ((file = file_from_full_path (path)))
     {
       FileHandle *fh = get_file_handle_from_info (fi);
@@ -1503,13 +2324,18 @@ vfs_write (const gchar *path, const gchar *buf, size_t len, off_t offset,
         {
           g_mutex_lock (&fh->mutex);
 
-          result = setup_output_stream (file, fh, fi->flags & O_APPEND);
+          /* Don't let further writes succeed after buffered data was lost */
+          result = fh->write_error;
+          if (result == 0)
+            result = setup_output_stream (file, fh, fi->flags & O_APPEND);
           if (result == 0)
             {
               result = write_stream (fh, fi->flags & O_APPEND,
                                      buf, len, offset);
             }
 
+          stat_cache_invalidate (path, FALSE);
+
           g_mutex_unlock (&fh->mutex);
           file_handle_unref (fh);
         }
@@ -1525,6 +2351,8 @@ vfs_write (const gchar *path, const gchar *buf, size_t len, off_t offset,
       result = -EIO;
     }
 
+  mount_gate_leave (gate);
+
   if (result < 0)
     g_debug ("vfs_write: -> %s\n", g_strerror (-result));
   else
@@ -1538,9 +2366,12 @@ vfs_opendir (const gchar *path, struct fuse_file_info *fi)
 {
   GFile *file;
   gint result = 0;
+  MountGate *gate;
 
   g_debug ("vfs_opendir: %s\n", path);
 
+  mount_gate_enter (path, &gate);
+
   if (path_is_mount_list (path))
     {
       /* Mount list */
@@ -1560,19 +2391,28 @@ vfs_opendir (const gchar *path, struct fuse_file_info *fi)
       result = -ENOENT;
     }
 
+  mount_gate_leave (gate);
   return result;
 }
 
 static gint
-readdir_for_file (GFile *base_file, gpointer buf, fuse_fill_dir_t filler)
+readdir_for_file (GFile *base_file, const gchar *path, gpointer buf, fuse_fill_dir_t filler)
 {
   GFileEnumerator *enumerator;
   GFileInfo       *file_info;
   GError          *error = NULL;
+  gchar           *attributes;
+  guint            generation;
+  struct stat      dir_sbuf;
 
   g_assert (base_file != NULL);
 
-  enumerator = g_file_enumerate_children (base_file, G_FILE_ATTRIBUTE_STANDARD_NAME, 0, NULL, &error);
+  /* Fetch the attributes along with the names, the entries are usually
+   * stat'ed right afterwards. */
+  attributes = g_strconcat (G_FILE_ATTRIBUTE_STANDARD_NAME ",", query_attributes, NULL);
+  generation = stat_cache_get_generation ();
+  enumerator = g_file_enumerate_children (base_file, attributes, 0, NULL, &error);
+  g_free (attributes);
   if (!enumerator)
     {
       gint result;
@@ -1592,12 +2432,29 @@ readdir_for_file (GFile *base_file, gpointer buf, fuse_fill_dir_t filler)
       return result;
     }
 
-  filler (buf, ".", NULL, 0);
-  filler (buf, "..", NULL, 0);
+  memset (&dir_sbuf, 0, sizeof (dir_sbuf));
+  dir_sbuf.st_mode = S_IFDIR;
 
+  filler (buf, ".", &dir_sbuf, 0);
+  filler (buf, "..", &dir_sbuf, 0);
+
+  /* The high-level API has no readdirplus, but passing the stat provides
+   * the entry types, and the cache answers the getattr calls that follow. */
   while ((file_info = g_file_enumerator_next_file (enumerator, NULL, &error)) != NULL)
     {
-      filler (buf, g_file_info_get_name (file_info), NULL, 0);
+      const gchar *name = g_file_info_get_name (file_info);
+      struct stat  sbuf;
+      gchar       *child_path;
+
+      memset (&sbuf, 0, sizeof (sbuf));
+      sbuf.st_blksize = 4096;
+      set_attributes_from_info (file_info, &sbuf);
+
+      child_path = g_build_path ("/", path, name, NULL);
+      stat_cache_insert (child_path, &sbuf, 0, generation);
+      g_free (child_path);
+
+      filler (buf, name, &sbuf, 0);
       g_object_unref (file_info);
     }
 
@@ -1612,17 +2469,24 @@ vfs_readdir (const gchar *path, gpointer buf, fuse_fill_dir_t filler, off_t offs
 {
   GFile       *base_file;
   gint         result = 0;
+  MountGate   *gate;
 
   g_debug ("vfs_readdir: %s\n", path);
 
+  mount_gate_enter (path, &gate);
+
   if (path_is_mount_list (path))
     {
       GList *l; 
+      struct stat dir_sbuf;
 
       /* Mount list */
 
-      filler (buf, ".", NULL, 0);
-      filler (buf, "..", NULL, 0);
+      memset (&dir_sbuf, 0, sizeof (dir_sbuf));
+      dir_sbuf.st_mode = S_IFDIR;
+
+      filler (buf, ".", &dir_sbuf, 0);
+      filler (buf, "..", &dir_sbuf, 0);
 
       mount_list_lock ();
 
@@ -1630,7 +2494,7 @@ vfs_readdir (const gchar *path, gpointer buf, fuse_fill_dir_t filler, off_t offs
         {
           MountRecord *mount_record = l->data;
 
-          filler (buf, mount_record->name, NULL, 0);
+          filler (buf, mount_record->name, &dir_sbuf, 0);
         }
 
       mount_list_unlock ();
@@ -1639,7 +2503,7 @@ vfs_readdir (const gchar *path, gpointer buf, fuse_fill_dir_t filler, off_t offs
     {
       /* Submount */
 
-      result = readdir_for_file (base_file, buf, filler);
+      result = readdir_for_file (base_file, path, buf, filler);
 
       g_object_unref (base_file);
     }
@@ -1650,6 +2514,7 @@ vfs_readdir (const gchar *path, gpointer buf, fuse_fill_dir_t filler, off_t offs
       result = -ENOENT;
     }
 
+  mount_gate_leave (gate);
   return result;
 }
 
@@ -1660,9 +2525,13 @@ vfs_rename (const gchar *old_path, const gchar *new_path)
   GFile  *new_file;
   GError *error  = NULL;
   gint    result = 0;
+  MountGate *old_gate;
+  MountGate *new_gate;
 
   g_debug ("vfs_rename: %s -> %s\n", old_path, new_path);
 
+  mount_gate_enter_pair (old_path, new_path, &old_gate, &new_gate);
+
   old_file = file_from_full_path (old_path);
   new_file = file_from_full_path (new_path);
 
@@ -1690,6 +2559,9 @@ vfs_rename (const gchar *old_path, const gchar *new_path)
           reindex_file_handle_for_path (old_path, new_path);
         }
 
+      stat_cache_invalidate_entry (old_path, TRUE);
+      stat_cache_invalidate_entry (new_path, TRUE);
+
       if (fh)
         {
           g_mutex_unlock (&fh->mutex);
@@ -1706,6 +2578,9 @@ vfs_rename (const gchar *old_path, const gchar *new_path)
   if (new_file)
     g_object_unref (new_file);
 
+  mount_gate_leave (old_gate);
+  mount_gate_leave (new_gate);
+
   g_debug ("vfs_rename: -> %s\n", g_strerror (-result));
 
   return result;
@@ -1717,9 +2592,12 @@ vfs_unlink (const gchar *path)
   GFile  *file;
   GError *error  = NULL;
   gint    result = 0;
+  MountGate *gate;
 
   g_debug ("vfs_unlink: %s\n", path);
 
+  mount_gate_enter (path, &gate);
+
   file = file_from_full_path (path);
 
   if (file)
@@ -1733,6 +2611,7 @@ vfs_unlink (const gchar *path)
         }
 
       g_file_delete (file, NULL, &error);
+      stat_cache_invalidate_entry (path, FALSE);
 
       if (fh)
         {
@@ -1755,6 +2634,8 @@ vfs_unlink (const gchar *path)
       result = -ENOENT;
     }
 
+  mount_gate_leave (gate);
+
   g_debug ("vfs_unlink: -> %s\n", g_strerror (-result));
 
   return result;
@@ -1766,9 +2647,12 @@ vfs_mkdir (const gchar *path, mode_t mode)
   GFile  *file;
   GError *error  = NULL;
   gint    result = 0;
+  MountGate *gate;
 
   g_debug ("vfs_mkdir: %s\n", path);
 
+  mount_gate_enter (path, &gate);
+
   file = file_from_full_path (path);
 
   if (file)
@@ -1780,6 +2664,8 @@ vfs_mkdir (const gchar *path, mode_t mode)
           g_file_set_attribute_uint32 (file, G_FILE_ATTRIBUTE_UNIX_MODE, mode, 0, NULL, NULL);
         }
 
+      stat_cache_invalidate_entry (path, FALSE);
+
       if (error)
         {
           result = -errno_from_error (error);
@@ -1793,6 +2679,8 @@ vfs_mkdir (const gchar *path, mode_t mode)
       result = -ENOENT;
     }
 
+  mount_gate_leave (gate);
+
   g_debug ("vfs_mkdir: -> %s\n", g_strerror (-result));
 
   return result;
@@ -1804,9 +2692,12 @@ vfs_rmdir (const gchar *path)
   GFile  *file;
   GError *error = NULL;
   gint   result = 0;
+  MountGate *gate;
 
   g_debug ("vfs_rmdir: %s\n", path);
 
+  mount_gate_enter (path, &gate);
+
   file = file_from_full_path (path);
 
   if (file)
@@ -1819,6 +2710,7 @@ vfs_rmdir (const gchar *path)
           if (g_file_info_get_file_type (file_info) == G_FILE_TYPE_DIRECTORY)
             {
               g_file_delete (file, NULL, &error);
+              stat_cache_invalidate_entry (path, TRUE);
 
               if (error)
                 {
@@ -1830,6 +2722,8 @@ vfs_rmdir (const gchar *path)
             {
               result = -ENOTDIR;
             }
+
+          g_object_unref (file_info);
         }
       else
         {
@@ -1843,12 +2737,16 @@ vfs_rmdir (const gchar *path)
               result = -ENOENT;
             }
         }
+
+      g_object_unref (file);
     }
   else
     {
       result = -ENOENT;
     }
 
+  mount_gate_leave (gate);
+
   g_debug ("vfs_rmdir: -> %s\n", g_strerror (-result));
 
   return result;
@@ -1887,7 +2785,7 @@ file_handle_get_size (FileHandle *fh,
   return res;
 }
 
-#define PAD_BLOCK_SIZE 65536
+#define PAD_BLOCK_SIZE (1024 * 1024)
 
 static gint
 pad_file (FileHandle *fh, gsize num, goffset current_size)
@@ -1900,7 +2798,7 @@ pad_file (FileHandle *fh, gsize num, goffset current_size)
   buf = g_malloc0 (PAD_BLOCK_SIZE);
   for (written = 0; written < num; written += PAD_BLOCK_SIZE)
     {
-      res = write_stream (fh, FALSE, buf, MIN (num - written, PAD_BLOCK_SIZE), current_size + written);
+      res = write_output_stream (fh, FALSE, buf, MIN (num - written, PAD_BLOCK_SIZE), current_size + written);
       if (res < 0)
         break;
     }
@@ -1916,6 +2814,12 @@ truncate_stream (GFile *file, FileHandle *fh, off_t size)
   GError *error  = NULL;
   int result = 0;
 
+  result = file_handle_flush_writes (fh);
+  if (result < 0)
+    return result;
+
+  read_cache_clear (fh);
+
   if (g_seekable_can_truncate (G_SEEKABLE (fh->stream)))
     {
       g_seekable_truncate (fh->stream, size, NULL, &error);
@@ -1950,8 +2854,9 @@ truncate_stream (GFile *file, FileHandle *fh, off_t size)
            * then we need to pad out the difference with 0's */
           goffset orig_pos = g_seekable_tell (G_SEEKABLE (fh->stream));
           result = pad_file (fh, size - current_size, current_size);
-          if (result == 0)
-            g_seekable_seek (G_SEEKABLE (fh->stream), orig_pos, G_SEEK_SET, NULL, &error);
+          if (result == 0 &&
+              g_seekable_seek (G_SEEKABLE (fh->stream), orig_pos, G_SEEK_SET, NULL, &error))
+            fh->pos = orig_pos;
         }
     }
   else
@@ -1976,9 +2881,12 @@ vfs_ftruncate (const gchar *path, off_t size, struct fuse_file_info *fi)
 {
   GFile  *file;
   gint    result = 0;
+  MountGate *gate;
 
   g_debug ("vfs_ftruncate: %s\n", path);
 
+  mount_gate_enter (path, &gate);
+
   file = file_from_full_path (path);
 
   if (file)
@@ -1994,6 +2902,8 @@ vfs_ftruncate (const gchar *path, off_t size, struct fuse_file_info *fi)
           if (result == 0)
             result = truncate_stream (file, fh, size);
 
+          stat_cache_invalidate (path, FALSE);
+
           g_mutex_unlock (&fh->mutex);
           file_handle_unref (fh);
         }
@@ -2009,6 +2919,8 @@ vfs_ftruncate (const gchar *path, off_t size, struct fuse_file_info *fi)
       result = -ENOENT;
     }
 
+  mount_gate_leave (gate);
+
   g_debug ("vfs_ftruncate: -> %s\n", g_strerror (-result));
 
   return result;
@@ -2020,9 +2932,12 @@ vfs_truncate (const gchar *path, off_t size)
   GFile  *file;
   GError *error  = NULL;
   gint    result = 0;
+  MountGate *gate;
 
   g_debug ("vfs_truncate: %s\n", path);
 
+  mount_gate_enter (path, &gate);
+
   file = file_from_full_path (path);
 
   if (file)
@@ -2063,8 +2978,14 @@ vfs_truncate (const gchar *path, off_t size)
               g_output_stream_close (G_OUTPUT_STREAM (file_output_stream), NULL, NULL);
               g_object_unref (file_output_stream);
             }
+
+          /* The file may be open for reading, its cached blocks are stale now */
+          if (fh)
+            read_cache_clear (fh);
         }
 
+      stat_cache_invalidate (path, FALSE);
+
       if (fh)
         {
           g_mutex_unlock (&fh->mutex);
@@ -2078,6 +2999,8 @@ vfs_truncate (const gchar *path, off_t size)
       result = -ENOENT;
     }
 
+  mount_gate_leave (gate);
+
   g_debug ("vfs_truncate: -> %s\n", g_strerror (-result));
 
   return result;
@@ -2089,26 +3012,34 @@ vfs_symlink (const gchar *path_old, const gchar *path_new)
   GFile  *file;
   GError *error  = NULL;
   gint    result = 0;
+  MountGate *gate;
 
   g_debug ("vfs_symlink: %s -> %s\n", path_new, path_old);
 
+  mount_gate_enter (path_new, &gate);
+
   file = file_from_full_path (path_new);
 
   if (file)
     {
       g_file_make_symbolic_link (file, path_old, NULL, &error);
+      stat_cache_invalidate_entry (path_new, FALSE);
 
       if (error)
         {
           result = -errno_from_error (error);
           g_error_free (error);
         }
+
+      g_object_unref (file);
     }
   else
     {
       result = -ENOENT;
     }
 
+  mount_gate_leave (gate);
+
   g_debug ("vfs_symlink: -> %s\n", g_strerror (-result));
 
   return result;
@@ -2120,9 +3051,12 @@ vfs_access (const gchar *path, gint mode)
   GFile  *file;
   GError *error  = NULL;
   gint    result = 0;
+  MountGate *gate;
 
   g_debug ("vfs_access: %s\n", path);
 
+  mount_gate_enter (path, &gate);
+
   file = file_from_full_path (path);
 
   if (file)
@@ -2184,6 +3118,8 @@ vfs_access (const gchar *path, gint mode)
       result = -ENOENT;
     }
 
+  mount_gate_leave (gate);
+
   g_debug ("vfs_access: -> %s\n", g_strerror (-result));
   return result;
 }
@@ -2194,9 +3130,12 @@ vfs_utimens (const gchar *path, const struct timespec tv [2])
   GFile  *file;
   GError *error  = NULL;
   gint    result = 0;
+  MountGate *gate;
 
   g_debug ("vfs_utimens: %s\n", path);
 
+  mount_gate_enter (path, &gate);
+
   file = file_from_full_path (path);
 
   if (file)
@@ -2232,6 +3171,7 @@ vfs_utimens (const gchar *path, const struct timespec tv [2])
       g_file_info_set_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_ACCESS_USEC, atime_usec);
 
       g_file_set_attributes_from_info (file, info, 0, NULL, &error);
+      stat_cache_invalidate (path, FALSE);
 
       if (error)
         {
@@ -2259,6 +3199,8 @@ vfs_utimens (const gchar *path, const struct timespec tv [2])
       result = -ENOENT;
     }
 
+  mount_gate_leave (gate);
+
   g_debug ("vfs_utimens: -> %s\n", g_strerror (-result));
   return result;
 }
@@ -2269,12 +3211,16 @@ vfs_chmod (const gchar *path, mode_t mode)
   GFile  *file;
   GError *error  = NULL;
   gint    result = 0;
+  MountGate *gate;
+
+  mount_gate_enter (path, &gate);
 
   file = file_from_full_path (path);
 
   if (file)
     {
       g_file_set_attribute_uint32 (file, G_FILE_ATTRIBUTE_UNIX_MODE, mode, 0, NULL, &error);
+      stat_cache_invalidate (path, FALSE);
 
       if (error)
         {
@@ -2285,6 +3231,7 @@ vfs_chmod (const gchar *path, mode_t mode)
       g_object_unref (file);
     }
 
+  mount_gate_leave (gate);
   return result;
 }
 
@@ -2321,6 +3268,11 @@ mount_tracker_unmounted_cb (GVolumeMonitor *volume_monitor,
 
       if (g_file_equal (root, mount_record->root))
         {
+          gchar *mount_path = g_strconcat ("/", mount_record->name, NULL);
+
+          stat_cache_invalidate (mount_path, TRUE);
+          g_free (mount_path);
+
           mount_list = g_list_delete_link (mount_list, l);
           mount_record_free (mount_record);
           break;
@@ -2407,6 +3359,10 @@ vfs_init (struct fuse_conn_info *conn)
                                                  NULL, (GDestroyNotify) file_handle_free);
   global_active_fh_map = g_hash_table_new_full (g_direct_hash, g_direct_equal,
                                                 NULL, NULL);
+  stat_cache_init ();
+  mount_gate_init ();
+  read_cache_init ();
+  write_buffer_init ();
 
   
   error = NULL;
@@ -2465,9 +3421,11 @@ vfs_init (struct fuse_conn_info *conn)
   /* Prevent out-of-order readahead */
   conn->async_read = 0;
 
-  /* Use up to a 64KiB write block size.  Only has an effect if -o big_writes
-   * is given on the command-line. */
-  conn->max_write = 65536;
+  /* Ask for writes of up to 1MiB.  Only has an effect if -o big_writes
+   * is given on the command-line, and libfuse lowers it to what the kernel
+   * channel supports (128KiB for the FUSE 2 protocol).  Smaller sequential
+   * writes are collected in the file handle's write buffer. */
+  conn->max_write = 1024 * 1024;
 
   return NULL;
 }
@@ -2506,6 +3464,8 @@ static struct fuse_operations vfs_oper =
   .open        = vfs_open,
   .create      = vfs_create,
   .release     = vfs_release,
+  .flush       = vfs_flush,
+  .fsync       = vfs_fsync,
 
   .read        = vfs_read,
   .write       = vfs_write,
@@ -2550,14 +3510,40 @@ main (gint argc, gchar *argv [])
   struct fuse *fuse;
   struct fuse_chan *ch;
   struct fuse_session *se;
+  struct fuse_args args = FUSE_ARGS_INIT (0, NULL);
   char *mountpoint;
+  char *timeouts;
+  gint64 ttl;
   int multithreaded;
   int res;
+  int i;
 
-  fuse = fuse_setup (argc, argv, &vfs_oper, sizeof (vfs_oper), &mountpoint,
-                     &multithreaded, NULL /* user data */);
+  /* Let the kernel keep attributes and lookups for as long as the stat
+   * cache does, it would otherwise ask again after one second. Failed
+   * lookups are not kept, so new mounts show up at the root right away.
+   * With the stat cache disabled the kernel defaults are left alone.
+   * Options given on the command line come later and take precedence. */
+  ttl = stat_cache_get_ttl ();
+
+  fuse_opt_add_arg (&args, argv[0]);
+  if (ttl > 0)
+    {
+      timeouts = g_strdup_printf ("-oattr_timeout=%" G_GINT64_FORMAT
+                                  ",entry_timeout=%" G_GINT64_FORMAT,
+                                  ttl, ttl);
+      fuse_opt_add_arg (&args, timeouts);
+      g_free (timeouts);
+    }
+  for (i = 1; i < argc; i++)
+    fuse_opt_add_arg (&args, argv[i]);
+
+  fuse = fuse_setup (args.argc, args.argv, &vfs_oper, sizeof (vfs_oper),
+                     &mountpoint, &multithreaded, NULL /* user data */);
   if (fuse == NULL)
-    return 1;
+    {
+      fuse_opt_free_args (&args);
+      return 1;
+    }
 
   if (multithreaded)
     res = fuse_loop_mt (fuse);
@@ -2574,6 +3560,7 @@ main (gint argc, gchar *argv [])
   fuse_unmount (mountpoint, ch);
   fuse_destroy (fuse);
   free (mountpoint);
+  fuse_opt_free_args (&args);
 
   if (res == -1)
     return 1;
@@ -27,14 +27,6 @@
 #include <gvfsdaemonprotocol.h>
 #include <gio/gio.h>
 
-static const char *
-get_object_signature (GObject *obj)
-{
-  if (G_IS_ICON (obj))
-      return "(us)";
-  return "(u)";
-}
-
 static GVariant *
 append_object (GObject *obj)
 {
@@ -97,88 +89,51 @@ _g_dbus_attribute_as_pointer (GFileAttributeType type,
   }
 }
 
-static const char *
-_g_dbus_type_from_file_attribute_type (GFileAttributeType type)
+GVariant *
+_g_dbus_append_file_attribute (const char *attribute,
+			       GFileAttributeStatus status,
+			       GFileAttributeType type,
+			       gpointer value_p)
 {
-  const char *dbus_type;
+  GVariant *v;
 
+  /* Build the values directly rather than from a format string, this is
+   * done for every attribute of every file sent */
   switch (type)
     {
     case G_FILE_ATTRIBUTE_TYPE_STRING:
-      dbus_type = "s";
+      v = g_variant_new_string (value_p);
       break;
     case G_FILE_ATTRIBUTE_TYPE_BYTE_STRING:
-      dbus_type = "ay";
+    case G_FILE_ATTRIBUTE_TYPE_INVALID:
+      v = g_variant_new_bytestring (value_p);
       break;
     case G_FILE_ATTRIBUTE_TYPE_STRINGV:
-      dbus_type = "as";
+      v = g_variant_new_strv (value_p, -1);
       break;
     case G_FILE_ATTRIBUTE_TYPE_BOOLEAN:
-      dbus_type = "b";
+      v = g_variant_new_boolean (*(gboolean *)value_p);
       break;
     case G_FILE_ATTRIBUTE_TYPE_UINT32:
-      dbus_type = "u";
+      v = g_variant_new_uint32 (*(guint32 *)value_p);
       break;
     case G_FILE_ATTRIBUTE_TYPE_INT32:
-      dbus_type = "i";
+      v = g_variant_new_int32 (*(gint32 *)value_p);
       break;
     case G_FILE_ATTRIBUTE_TYPE_UINT64:
-      dbus_type = "t";
+      v = g_variant_new_uint64 (*(guint64 *)value_p);
       break;
     case G_FILE_ATTRIBUTE_TYPE_INT64:
-      dbus_type = "x";
+      v = g_variant_new_int64 (*(gint64 *)value_p);
       break;
     case G_FILE_ATTRIBUTE_TYPE_OBJECT:
-      dbus_type = "r";
-      break;
-    case G_FILE_ATTRIBUTE_TYPE_INVALID:
-      dbus_type = "ay";
+      v = append_object ((GObject *)value_p);
       break;
     default:
-      dbus_type = NULL;
       g_warning ("Invalid attribute type %u, ignoring\n", type);
+      v = g_variant_new_byte (0);
       break;
     }
-
-  return dbus_type;
-}
-
-GVariant *
-_g_dbus_append_file_attribute (const char *attribute,
-			       GFileAttributeStatus status,
-			       GFileAttributeType type,
-			       gpointer value_p)
-{
-  const char *dbus_type;
-  GVariant *v;
-
-  dbus_type = _g_dbus_type_from_file_attribute_type (type);
-
-  if (g_variant_type_equal (G_VARIANT_TYPE (dbus_type), G_VARIANT_TYPE_TUPLE))
-    dbus_type = get_object_signature ((GObject *)value_p);
-
-  if (g_variant_type_is_tuple (G_VARIANT_TYPE (dbus_type)))
-    v = append_object ((GObject *)value_p);
-  else if (g_variant_type_is_array (G_VARIANT_TYPE (dbus_type)))
-    {
-      char *s;
-      
-      s = g_strdup_printf ("^%s", dbus_type);
-      v = g_variant_new (s, value_p);
-      g_free (s);
-    }
-  else if (g_variant_type_equal (G_VARIANT_TYPE (dbus_type), G_VARIANT_TYPE_UINT32))
-    v = g_variant_new (dbus_type, *(guint32 *)value_p);
-  else if (g_variant_type_equal (G_VARIANT_TYPE (dbus_type), G_VARIANT_TYPE_INT32))
-    v = g_variant_new (dbus_type, *(gint32 *)value_p);
-  else if (g_variant_type_equal (G_VARIANT_TYPE (dbus_type), G_VARIANT_TYPE_UINT64))
-    v = g_variant_new (dbus_type, *(guint64 *)value_p);
-  else if (g_variant_type_equal (G_VARIANT_TYPE (dbus_type), G_VARIANT_TYPE_INT64))
-    v = g_variant_new (dbus_type, *(gint64 *)value_p);
-  else if (g_variant_type_equal (G_VARIANT_TYPE (dbus_type), G_VARIANT_TYPE_BOOLEAN))
-    v = g_variant_new (dbus_type, *(gboolean *)value_p);
-  else
-    v = g_variant_new (dbus_type, value_p);
   
   return g_variant_new ("(suv)",
                         attribute,
@@ -186,6 +141,11 @@ _g_dbus_append_file_attribute (const char *attribute,
                         v);
 }
 
+/* The a(suv) encoding with full attribute names is part of the D-Bus
+ * interfaces, which clients and daemons of different versions share
+ * (e.g. an updated gvfsd with applications still running the old
+ * library). It is kept as is instead of a per connection negotiated
+ * compact encoding. */
 GVariant *
 _g_dbus_append_file_info (GFileInfo *info)
 {
@@ -211,110 +171,120 @@ _g_dbus_append_file_info (GFileInfo *info)
   return g_variant_builder_end (&builder);
 }
 
-gboolean
-_g_dbus_get_file_attribute (GVariant *value,
-			    gchar **attribute,
-			    GFileAttributeStatus *status,
-			    GFileAttributeType *type,
-			    GDBusAttributeValue *attr_value)
+static gboolean
+get_file_attribute_value (GVariant *v,
+			  GFileAttributeType *type,
+			  GDBusAttributeValue *attr_value)
 {
-  gboolean res;
   char *str;
   guint32 obj_type;
   GObject *obj;
-  GVariant *v;
 
-  g_variant_get (value, "(suv)",
-                 attribute,
-                 status,
-                 &v);
-
-  res = TRUE;
-  if (g_variant_is_of_type (v, G_VARIANT_TYPE_STRING))
+  switch (g_variant_classify (v))
     {
+    case G_VARIANT_CLASS_STRING:
       *type = G_FILE_ATTRIBUTE_TYPE_STRING;
-      g_variant_get (v, "s", &attr_value->ptr);
-    } 
-  else if (g_variant_is_of_type (v, G_VARIANT_TYPE_BYTESTRING))
-    {
-      *type = G_FILE_ATTRIBUTE_TYPE_BYTE_STRING;
-      g_variant_get (v, "^ay", &attr_value->ptr);
-    } 
-  else if (g_variant_is_of_type (v, G_VARIANT_TYPE_STRING_ARRAY))
-    {
-      *type = G_FILE_ATTRIBUTE_TYPE_STRINGV;
-      g_variant_get (v, "^as", &attr_value->ptr);
-    } 
-  else if (g_variant_is_of_type (v, G_VARIANT_TYPE_BYTE))
-    {
+      attr_value->ptr = g_variant_dup_string (v, NULL);
+      return TRUE;
+    case G_VARIANT_CLASS_BYTE:
       *type = G_FILE_ATTRIBUTE_TYPE_INVALID;
-    } 
-  else if (g_variant_is_of_type (v, G_VARIANT_TYPE_BOOLEAN))
-    {
+      return TRUE;
+    case G_VARIANT_CLASS_BOOLEAN:
       *type = G_FILE_ATTRIBUTE_TYPE_BOOLEAN;
-      g_variant_get (v, "b", &attr_value->boolean);
-    } 
-  else if (g_variant_is_of_type (v, G_VARIANT_TYPE_UINT32))
-    {
+      attr_value->boolean = g_variant_get_boolean (v);
+      return TRUE;
+    case G_VARIANT_CLASS_UINT32:
       *type = G_FILE_ATTRIBUTE_TYPE_UINT32;
-      g_variant_get (v, "u", &attr_value->uint32);
-    } 
-  else if (g_variant_is_of_type (v, G_VARIANT_TYPE_INT32))
-    {
+      attr_value->uint32 = g_variant_get_uint32 (v);
+      return TRUE;
+    case G_VARIANT_CLASS_INT32:
       *type = G_FILE_ATTRIBUTE_TYPE_INT32;
-      g_variant_get (v, "i", &attr_value->ptr);
-    } 
-  else if (g_variant_is_of_type (v, G_VARIANT_TYPE_UINT64))
-    {
+      attr_value->uint32 = g_variant_get_int32 (v);
+      return TRUE;
+    case G_VARIANT_CLASS_UINT64:
       *type = G_FILE_ATTRIBUTE_TYPE_UINT64;
-      g_variant_get (v, "t", &attr_value->uint64);
-    } 
-  else if (g_variant_is_of_type (v, G_VARIANT_TYPE_INT64))
-    {
+      attr_value->uint64 = g_variant_get_uint64 (v);
+      return TRUE;
+    case G_VARIANT_CLASS_INT64:
       *type = G_FILE_ATTRIBUTE_TYPE_INT64;
-      g_variant_get (v, "x", &attr_value->ptr);
-    } 
-  else if (g_variant_is_container (v))
+      attr_value->uint64 = g_variant_get_int64 (v);
+      return TRUE;
+    default:
+      break;
+    }
+
+  if (g_variant_is_of_type (v, G_VARIANT_TYPE_BYTESTRING))
     {
-      *type = G_FILE_ATTRIBUTE_TYPE_OBJECT;
-      obj_type = G_MAXUINT32;   /* treat it as an error if not set below */
-      str = NULL;
+      *type = G_FILE_ATTRIBUTE_TYPE_BYTE_STRING;
+      attr_value->ptr = g_variant_dup_bytestring (v, NULL);
+      return TRUE;
+    }
 
-      if (g_variant_is_of_type (v, G_VARIANT_TYPE ("(u)")))
-        {
-          g_variant_get (v, "(u)", &obj_type);
-        }
-      else if (g_variant_is_of_type (v, G_VARIANT_TYPE ("(us)")))
-        {
-          g_variant_get (v, "(u&s)", &obj_type, &str);
-        }
-      
-      obj = NULL;
+  if (g_variant_is_of_type (v, G_VARIANT_TYPE_STRING_ARRAY))
+    {
+      *type = G_FILE_ATTRIBUTE_TYPE_STRINGV;
+      attr_value->ptr = g_variant_dup_strv (v, NULL);
+      return TRUE;
+    }
+
+  if (!g_variant_is_container (v))
+    return FALSE;
+
+  *type = G_FILE_ATTRIBUTE_TYPE_OBJECT;
+  obj_type = G_MAXUINT32;   /* treat it as an error if not set below */
+  str = NULL;
+
+  if (g_variant_is_of_type (v, G_VARIANT_TYPE ("(u)")))
+    {
+      g_variant_get (v, "(u)", &obj_type);
+    }
+  else if (g_variant_is_of_type (v, G_VARIANT_TYPE ("(us)")))
+    {
+      g_variant_get (v, "(u&s)", &obj_type, &str);
+    }
+
+  obj = NULL;
 
-      /* obj_type 1 and 2 are deprecated and treated as errors */
-      if (obj_type == 3)
+  /* obj_type 1 and 2 are deprecated and treated as errors */
+  if (obj_type == 3)
+    {
+      if (str != NULL)
         {
-          if (str != NULL)
-            {
-              /* serialized G_ICON */
-              obj = (GObject *)g_icon_new_for_string (str, NULL);
-            }
-          else
-            {
-              g_warning ("Malformed object data in file attribute");
-            }
+          /* serialized G_ICON */
+          obj = (GObject *)g_icon_new_for_string (str, NULL);
         }
       else
         {
-          /* NULL (or unsupported) */
-          if (obj_type != 0)
-            g_warning ("Unsupported object type in file attribute");
+          g_warning ("Malformed object data in file attribute");
         }
-      attr_value->ptr = obj;
-    } 
+    }
   else
-    res = FALSE;
+    {
+      /* NULL (or unsupported) */
+      if (obj_type != 0)
+        g_warning ("Unsupported object type in file attribute");
+    }
+  attr_value->ptr = obj;
+
+  return TRUE;
+}
+
+gboolean
+_g_dbus_get_file_attribute (GVariant *value,
+			    gchar **attribute,
+			    GFileAttributeStatus *status,
+			    GFileAttributeType *type,
+			    GDBusAttributeValue *attr_value)
+{
+  gboolean res;
+  GVariant *v;
+
+  g_variant_get (value, "(suv)",
+                 attribute,
+                 status,
+                 &v);
 
+  res = get_file_attribute_value (v, type, attr_value);
   g_variant_unref (v);
   
   return res;
@@ -325,29 +295,32 @@ _g_dbus_get_file_info (GVariant *value,
 		       GError **error)
 {
   GFileInfo *info;
-  gchar *attribute;
+  const gchar *attribute;
   GFileAttributeType type;
   GFileAttributeStatus status;
   GDBusAttributeValue attr_value;
   GVariantIter iter;
-  GVariant *child;
+  GVariant *v;
 
   info = g_file_info_new ();
 
+  /* Borrow the attribute names, this is done for every file received */
   g_variant_iter_init (&iter, value);
-  while ((child = g_variant_iter_next_value (&iter)))
+  while (g_variant_iter_next (&iter, "(&suv)", &attribute, &status, &v))
     {
-      if (!_g_dbus_get_file_attribute (child, &attribute, &status, &type, &attr_value))
-        goto error;
+      if (!get_file_attribute_value (v, &type, &attr_value))
+        {
+          g_variant_unref (v);
+          goto error;
+        }
 
       g_file_info_set_attribute (info, attribute, type, _g_dbus_attribute_as_pointer (type, &attr_value));
       if (status)
         g_file_info_set_attribute_status (info, attribute, status);
 
-      g_free (attribute);
       _g_dbus_attribute_value_destroy (type, &attr_value);
 
-      g_variant_unref (child);
+      g_variant_unref (v);
     }
 
   return info;
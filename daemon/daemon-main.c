@@ -362,6 +362,17 @@ daemon_main (int argc,
   data = g_new0 (DaemonData, 1);
   data->mountable_name = g_strdup (mountable_name);
   data->max_job_threads = max_job_threads;
+
+  /* Backends built with more than one job thread are thread-safe, so their
+   * parallelism may be tuned at runtime. Others must stay serialized. */
+  if (max_job_threads > 1 && g_getenv ("GVFS_MAX_JOB_THREADS"))
+    {
+      int threads = atoi (g_getenv ("GVFS_MAX_JOB_THREADS"));
+
+      if (threads > 0)
+        data->max_job_threads = threads;
+    }
+
   data->mount_spec = daemon_parse_args (argc, argv, default_type);
   
   va_start (var_args, first_type_name);
@@ -33,6 +33,7 @@
 #include <glib.h>
 #include <glib/gi18n.h>
 #include <gio/gio.h>
+#include <gio/gfiledescriptorbased.h>
 #include <polkit/polkit.h>
 
 #include "gvfsbackendadmin.h"
@@ -365,6 +366,15 @@ do_read (GVfsBackend *backend,
   GError *error = NULL;
   gssize bytes;
 
+  /* Let the kernel copy regular files to the client */
+  if (G_IS_FILE_DESCRIPTOR_BASED (stream) &&
+      g_vfs_job_read_set_from_fd (read_job,
+                                  g_file_descriptor_based_get_fd (G_FILE_DESCRIPTOR_BASED (stream))))
+    {
+      complete_job (job, NULL);
+      return;
+    }
+
   bytes = g_input_stream_read (stream, buffer, bytes_requested,
                                job->cancellable, &error);
   if (bytes > -1)
@@ -243,12 +243,24 @@ gvfs_backend_ftp_determine_system (GVfsFtpTask *task)
 static void
 gvfs_backend_ftp_setup_directory_cache (GVfsBackendFtp *ftp)
 {
+  const char *size, *ttl;
+
   if (ftp->system == G_VFS_FTP_SYSTEM_UNIX)
     ftp->dir_funcs = &g_vfs_ftp_dir_cache_funcs_unix;
   else
     ftp->dir_funcs = &g_vfs_ftp_dir_cache_funcs_default;
 
   ftp->dir_cache = g_vfs_ftp_dir_cache_new (ftp->dir_funcs);
+
+  /* Allow tuning the cache for huge servers, size is in KiB, TTL in seconds */
+  size = g_getenv ("GVFS_FTP_DIR_CACHE_SIZE");
+  ttl = g_getenv ("GVFS_FTP_DIR_CACHE_TTL");
+  if (size || ttl)
+    g_vfs_ftp_dir_cache_set_limits (ftp->dir_cache,
+                                    size ? g_ascii_strtoull (size, NULL, 10) * 1024
+                                         : G_VFS_FTP_DIR_CACHE_DEFAULT_MAX_SIZE,
+                                    ttl ? g_ascii_strtoull (ttl, NULL, 10)
+                                        : G_VFS_FTP_DIR_CACHE_DEFAULT_TTL);
 }
 
 /* This parses a file according to RFC 959 Appendix II:
@@ -1265,6 +1277,27 @@ do_set_attribute (GVfsBackend *backend,
   g_vfs_ftp_file_free (file);
 }
 
+static void
+do_enumerate_add_info (GVfsFtpFile *file,
+                       GFileInfo *  info,
+                       gpointer     user_data)
+{
+  GVfsJobEnumerate *job = user_data;
+  GFileInfo *matched_info;
+
+  /* Reply as soon as the first file is known, so the client can start
+   * processing while the rest of the listing is still being received */
+  if (!G_VFS_JOB (job)->sent_reply)
+    g_vfs_job_succeeded (G_VFS_JOB (job));
+
+  /* copy into a new GFileInfo as g_vfs_job_enumerate_add_info()
+   * modifies the given GFileInfo */
+  matched_info = g_file_info_new ();
+  g_file_info_copy_into (info, matched_info);
+  g_vfs_job_enumerate_add_info (job, matched_info);
+  g_object_unref (matched_info);
+}
+
 static void
 do_enumerate (GVfsBackend *backend,
               GVfsJobEnumerate *job,
@@ -1275,38 +1308,37 @@ do_enumerate (GVfsBackend *backend,
   GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
   GVfsFtpTask task = G_VFS_FTP_TASK_INIT (ftp, G_VFS_JOB (job));
   GVfsFtpFile *dir;
-  GList *list, *walk;
 
   dir = g_vfs_ftp_file_new_from_gvfs (ftp, dirname);
-  list = g_vfs_ftp_dir_cache_lookup_dir (ftp->dir_cache,
-                                         &task,
-                                         dir,
-                                         TRUE,
-                                         query_flags & G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS ? FALSE : TRUE);
+  g_vfs_ftp_dir_cache_enumerate_dir (ftp->dir_cache,
+                                     &task,
+                                     dir,
+                                     TRUE,
+                                     query_flags & G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS ? FALSE : TRUE,
+                                     do_enumerate_add_info,
+                                     job);
   g_vfs_ftp_file_free (dir);
-  if (g_vfs_ftp_task_is_in_error (&task))
+
+  if (G_VFS_JOB (job)->sent_reply)
+    {
+      /* too late to fail the job, so end the listing with the error */
+      task.job = NULL;
+      if (g_vfs_ftp_task_is_in_error (&task))
+        {
+          g_debug ("# enumerate of %s aborted: %s\n", dirname, task.error->message);
+          g_vfs_job_enumerate_done_with_error (job, task.error);
+          g_vfs_ftp_task_done (&task);
+          return;
+        }
+    }
+  else if (g_vfs_ftp_task_is_in_error (&task))
     {
-      g_assert (list == NULL);
       g_vfs_ftp_task_done (&task);
       return;
     }
 
   g_vfs_ftp_task_done (&task);
-
-  for (walk = list; walk; walk = walk->next)
-    {
-      GFileInfo *matched_info = g_file_info_new ();
-
-      /* copy into a new GFileInfo as g_vfs_job_enumerate_add_info()
-       * modifies the given GFileInfo */
-      g_file_info_copy_into (walk->data, matched_info);
-      g_vfs_job_enumerate_add_info (job, matched_info);
-      g_object_unref (matched_info);
-      g_object_unref (walk->data);
-    }
   g_vfs_job_enumerate_done (job);
-
-  g_list_free (list);
 }
 
 static void
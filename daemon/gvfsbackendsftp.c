@@ -93,6 +93,12 @@
  */
 #define MAX_BUFFER_SIZE 32768
 
+/* Never have more than this many read requests outstanding per handle */
+#define READ_MAX_REQUESTS 64
+
+/* Never have more than this many write requests outstanding per handle */
+#define WRITE_MAX_REQUESTS 64
+
 static GQuark id_q;
 
 typedef enum {
@@ -144,7 +150,14 @@ typedef struct {
   gsize size;
 } DataBuffer;
 
-typedef struct {
+typedef struct _SftpHandle SftpHandle;
+
+typedef void (*WriteFlushedCallback) (GVfsBackendSftp *backend,
+                                      SftpHandle *handle,
+                                      GVfsJob *job);
+
+struct _SftpHandle {
+  GVfsBackendSftp *backend;
   DataBuffer *raw_handle;
   goffset offset;
   char *filename;
@@ -152,7 +165,21 @@ typedef struct {
   guint32 permissions;
   gboolean set_permissions;
   gboolean make_backup;
-} SftpHandle;
+
+  /* Read pipelining, see try_read () */
+  GQueue read_requests;
+  goffset read_request_offset;
+  int read_max_req;
+  gboolean read_eof;
+  GVfsJobRead *read_job;
+
+  /* Write pipelining, see try_write () */
+  int write_num_req;
+  GError *write_error;
+  GVfsJob *write_job;
+  int write_job_max_req;
+  WriteFlushedCallback write_job_callback;
+};
 
 
 typedef struct {
@@ -206,6 +233,9 @@ struct _GVfsBackendSftp
   Connection command_connection;
   Connection data_connection;
 
+  /* Open SftpHandles, their parked jobs wait for no reply */
+  GList *handles;
+
   gboolean force_unmounted;
 };
 
@@ -303,6 +333,7 @@ g_vfs_backend_sftp_finalize (GObject *object)
   backend = G_VFS_BACKEND_SFTP (object);
   destroy_connection (&backend->command_connection);
   destroy_connection (&backend->data_connection);
+  g_list_free (backend->handles);
 
   if (G_OBJECT_CLASS (g_vfs_backend_sftp_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_vfs_backend_sftp_parent_class)->finalize) (object);
@@ -1358,7 +1389,40 @@ fail_jobs (Connection *conn, GError *error)
   while (g_hash_table_iter_next (&iter, &key, &value))
     {
       ExpectedReply *expected_reply = (ExpectedReply *) value;
-      g_vfs_job_failed_from_error (expected_reply->job, error);
+
+      /* Requests may be sent on behalf of jobs that already replied */
+      if (!expected_reply->job->sent_reply)
+        g_vfs_job_failed_from_error (expected_reply->job, error);
+    }
+}
+
+static void
+fail_parked_job (GVfsJob **job, GError *error)
+{
+  GVfsJob *parked_job = *job;
+
+  if (parked_job == NULL)
+    return;
+
+  *job = NULL;
+  if (!parked_job->sent_reply)
+    g_vfs_job_failed_from_error (parked_job, error);
+  g_object_unref (parked_job);
+}
+
+/* Jobs waiting on a handle are not registered under any expected reply,
+ * the requests they wait for were queued on behalf of earlier jobs. */
+static void
+fail_handle_jobs (GVfsBackendSftp *backend, GError *error)
+{
+  GList *l;
+
+  for (l = backend->handles; l != NULL; l = l->next)
+    {
+      SftpHandle *handle = l->data;
+
+      fail_parked_job ((GVfsJob **) &handle->read_job, error);
+      fail_parked_job (&handle->write_job, error);
     }
 }
 
@@ -1372,6 +1436,7 @@ fail_jobs_and_unmount (GVfsBackendSftp *backend, GError *error)
 
   fail_jobs (&backend->command_connection, error);
   fail_jobs (&backend->data_connection, error);
+  fail_handle_jobs (backend, error);
 
   g_error_free (error);
 
@@ -2614,14 +2679,63 @@ parse_attributes (GVfsBackendSftp *backend,
     }
 }
 
+/* The read sliding window is similar to the pull one below, but the data
+ * is handed out to the read jobs of the channel in order instead of being
+ * written to a local file. The requests in the window are kept sorted by
+ * offset, the first one always starts at the current offset of the handle.
+ */
+typedef struct {
+  SftpHandle *handle;     /* NULL once the request was dropped from the window */
+  guint64 request_offset; /* offset of requested bytes */
+  guint32 request_len;    /* number of bytes requested */
+  gboolean done;          /* reply received */
+  gboolean eof;
+  GError *error;
+  char *buffer;
+  gsize response_len;     /* number of bytes returned */
+  gsize read_offset;      /* offset in buffer of bytes consumed so far */
+} ReadRequest;
+
+static void
+read_request_free (ReadRequest *request)
+{
+  g_free (request->buffer);
+  g_clear_error (&request->error);
+  g_slice_free (ReadRequest, request);
+}
+
+/* Drop all the requests in the window and restart it from the current
+ * offset. Replies for outstanding requests are just thrown away. */
+static void
+read_window_reset (SftpHandle *handle)
+{
+  ReadRequest *request;
+
+  while ((request = g_queue_pop_head (&handle->read_requests)) != NULL)
+    {
+      if (request->done)
+        read_request_free (request);
+      else
+        request->handle = NULL;
+    }
+
+  handle->read_request_offset = handle->offset;
+  handle->read_eof = FALSE;
+}
+
 static SftpHandle *
-sftp_handle_new (GDataInputStream *reply)
+sftp_handle_new (GVfsBackendSftp *backend,
+                 GDataInputStream *reply)
 {
   SftpHandle *handle;
 
   handle = g_slice_new0 (SftpHandle);
+  handle->backend = backend;
+  backend->handles = g_list_prepend (backend->handles, handle);
   handle->raw_handle = read_data_buffer (reply);
   handle->offset = 0;
+  g_queue_init (&handle->read_requests);
+  handle->read_max_req = 1;
 
   return handle;
 }
@@ -2629,6 +2743,11 @@ sftp_handle_new (GDataInputStream *reply)
 static void
 sftp_handle_free (SftpHandle *handle)
 {
+  handle->backend->handles = g_list_remove (handle->backend->handles, handle);
+  read_window_reset (handle);
+  g_clear_object (&handle->read_job);
+  g_clear_error (&handle->write_error);
+  g_clear_object (&handle->write_job);
   data_buffer_free (handle->raw_handle);
   g_free (handle->filename);
   g_free (handle->tempname);
@@ -2733,7 +2852,7 @@ open_for_read_reply (GVfsBackendSftp *backend,
       return;
     }
 
-  handle = sftp_handle_new (reply);
+  handle = sftp_handle_new (backend, reply);
   
   g_vfs_job_open_for_read_set_handle (G_VFS_JOB_OPEN_FOR_READ (job), handle);
   g_vfs_job_open_for_read_set_can_seek (G_VFS_JOB_OPEN_FOR_READ (job), TRUE);
@@ -2770,6 +2889,10 @@ try_open_for_read (GVfsBackend *backend,
   return TRUE;
 }
 
+static gboolean read_try_complete (GVfsBackendSftp *backend,
+                                   SftpHandle      *handle,
+                                   GVfsJobRead     *job);
+
 static void
 read_reply (GVfsBackendSftp *backend,
             int reply_type,
@@ -2778,39 +2901,176 @@ read_reply (GVfsBackendSftp *backend,
             GVfsJob *job,
             gpointer user_data)
 {
-  SftpHandle *handle;
-  guint32 count;
-  
-  handle = user_data;
-  
+  ReadRequest *request = user_data;
+  SftpHandle *handle = request->handle;
+  GVfsJobRead *read_job;
+  guint32 code;
+
+  request->done = TRUE;
+
   if (reply_type == SSH_FXP_STATUS)
     {
-      result_from_status (job, reply, -1, SSH_FX_EOF);
-      return;
+      code = read_status_code (reply);
+      if (error_from_status_code (job, code, -1, SSH_FX_EOF, &request->error))
+        request->eof = TRUE;
+    }
+  else if (reply_type != SSH_FXP_DATA)
+    {
+      request->error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                            _("Invalid reply received"));
+    }
+  else
+    {
+      request->response_len = g_data_input_stream_read_uint32 (reply, NULL, NULL);
+      request->buffer = g_malloc (request->response_len);
+
+      if (!g_input_stream_read_all (G_INPUT_STREAM (reply),
+                                    request->buffer, request->response_len,
+                                    NULL, NULL, NULL))
+        request->error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                              _("Invalid reply received"));
+      else if (request->response_len == 0)
+        request->eof = TRUE;
     }
 
-  if (reply_type != SSH_FXP_DATA)
+  if (handle == NULL)
     {
-      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                        _("Invalid reply received"));
+      /* Dropped by a seek or close */
+      read_request_free (request);
       return;
     }
-  
-  count = g_data_input_stream_read_uint32 (reply, NULL, NULL);
 
-  if (!g_input_stream_read_all (G_INPUT_STREAM (reply),
-                                G_VFS_JOB_READ (job)->buffer, count,
-                                NULL, NULL, NULL))
+  if (request->eof)
+    handle->read_eof = TRUE;
+
+  /* Complete the read job waiting for this data, if any */
+  read_job = handle->read_job;
+  handle->read_job = NULL;
+  if (read_job != NULL)
     {
-      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                        _("Invalid reply received"));
-      return;
+      if (read_try_complete (backend, handle, read_job))
+        g_object_unref (read_job);
+      else
+        handle->read_job = read_job;
     }
-  
-  handle->offset += count;
+}
 
-  g_vfs_job_read_set_size (G_VFS_JOB_READ (job), count);
-  g_vfs_job_succeeded (job);
+static void
+read_enqueue_request (GVfsBackendSftp *backend,
+                      SftpHandle *handle,
+                      GVfsJob *job)
+{
+  ReadRequest *request;
+  GDataOutputStream *command;
+
+  request = g_slice_new0 (ReadRequest);
+  request->handle = handle;
+  request->request_offset = handle->read_request_offset;
+  request->request_len = MAX_BUFFER_SIZE;
+
+  command = new_command_stream (backend, SSH_FXP_READ);
+  put_data_buffer (command, handle->raw_handle);
+  g_data_output_stream_put_uint64 (command, request->request_offset, NULL, NULL);
+  g_data_output_stream_put_uint32 (command, request->request_len, NULL, NULL);
+  queue_command_stream_and_free (&backend->command_connection, command,
+                                 read_reply,
+                                 job, request);
+
+  g_queue_push_tail (&handle->read_requests, request);
+  handle->read_request_offset += request->request_len;
+}
+
+/* Keep at least n_requests (and the current window size) in flight,
+ * unless we already know where the file ends. */
+static void
+read_window_fill (GVfsBackendSftp *backend,
+                  SftpHandle *handle,
+                  GVfsJob *job,
+                  guint n_requests)
+{
+  n_requests = MAX (n_requests, handle->read_max_req);
+  n_requests = MIN (n_requests, READ_MAX_REQUESTS);
+
+  while (!handle->read_eof &&
+         g_queue_get_length (&handle->read_requests) < n_requests)
+    read_enqueue_request (backend, handle, job);
+}
+
+/* Hand out the data at the start of the window to the job. Returns FALSE
+ * if the job has to wait for more replies. */
+static gboolean
+read_try_complete (GVfsBackendSftp *backend,
+                   SftpHandle *handle,
+                   GVfsJobRead *job)
+{
+  ReadRequest *request;
+  gboolean short_read;
+  gsize count, n;
+
+  count = 0;
+  while (count < job->bytes_requested &&
+         (request = g_queue_peek_head (&handle->read_requests)) != NULL &&
+         request->done &&
+         request->error == NULL &&
+         !request->eof)
+    {
+      n = MIN (job->bytes_requested - count,
+               request->response_len - request->read_offset);
+      memcpy (job->buffer + count, request->buffer + request->read_offset, n);
+      request->read_offset += n;
+      handle->offset += n;
+      count += n;
+
+      if (request->read_offset == request->response_len)
+        {
+          g_queue_pop_head (&handle->read_requests);
+          short_read = request->response_len < request->request_len;
+          read_request_free (request);
+
+          /* The following requests don't start where this one ended */
+          if (short_read)
+            {
+              read_window_reset (handle);
+              break;
+            }
+
+          /* Sequential access, try to increase the number of
+           * concurrent requests */
+          if (handle->read_max_req < READ_MAX_REQUESTS)
+            handle->read_max_req++;
+        }
+    }
+
+  if (count == 0)
+    {
+      request = g_queue_peek_head (&handle->read_requests);
+      if (request == NULL)
+        {
+          read_window_fill (backend, handle, G_VFS_JOB (job), 1);
+          return FALSE;
+        }
+
+      if (!request->done)
+        return FALSE;
+
+      /* Report errors and EOF only once all the data before them was read */
+      if (request->error)
+        g_vfs_job_failed_from_error (G_VFS_JOB (job), request->error);
+
+      handle->read_max_req = 1;
+      read_window_reset (handle);
+
+      if (G_VFS_JOB (job)->failed)
+        return TRUE;
+    }
+
+  g_vfs_job_read_set_size (job, count);
+  g_vfs_job_succeeded (G_VFS_JOB (job));
+
+  if (count > 0)
+    read_window_fill (backend, handle, G_VFS_JOB (job), 0);
+
+  return TRUE;
 }
 
 static gboolean
@@ -2822,17 +3082,15 @@ try_read (GVfsBackend *backend,
 {
   SftpHandle *handle = _handle;
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
 
-  command = new_command_stream (op_backend,
-                                SSH_FXP_READ);
-  put_data_buffer (command, handle->raw_handle);
-  g_data_output_stream_put_uint64 (command, handle->offset, NULL, NULL);
-  g_data_output_stream_put_uint32 (command, bytes_requested, NULL, NULL);
-  
-  queue_command_stream_and_free (&op_backend->command_connection, command,
-                                 read_reply,
-                                 G_VFS_JOB (job), handle);
+  /* Instead of doing one request per read we keep a window of read
+   * requests in flight, which grows as long as the file is read
+   * sequentially. */
+  read_window_fill (op_backend, handle, G_VFS_JOB (job),
+                    (bytes_requested + MAX_BUFFER_SIZE - 1) / MAX_BUFFER_SIZE);
+
+  if (!read_try_complete (op_backend, handle, job))
+    handle->read_job = g_object_ref (job);
 
   return TRUE;
 }
@@ -2878,6 +3136,9 @@ seek_read_fstat_reply (GVfsBackendSftp *backend,
   if (handle->offset < 0)
     handle->offset = 0;
 
+  handle->read_max_req = 1;
+  read_window_reset (handle);
+
   g_vfs_job_seek_read_set_offset (op_job, handle->offset);
   g_vfs_job_succeeded (job);
 }
@@ -2892,6 +3153,9 @@ try_seek_on_read (GVfsBackend *backend,
   SftpHandle *handle = _handle;
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
+  goffset old_offset;
+
+  old_offset = handle->offset;
 
   switch (job->seek_type)
     {
@@ -2914,6 +3178,13 @@ try_seek_on_read (GVfsBackend *backend,
   if (handle->offset < 0)
     handle->offset = 0;
 
+  /* The window is still valid when seeking to the current position */
+  if (handle->offset != old_offset)
+    {
+      handle->read_max_req = 1;
+      read_window_reset (handle);
+    }
+
   g_vfs_job_seek_read_set_offset (job, handle->offset);
   g_vfs_job_succeeded (G_VFS_JOB (job));
 
@@ -3142,6 +3413,15 @@ close_write_reply (GVfsBackendSftp *backend,
     g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
 	                 _("Invalid reply received"));
 
+  /* A write failed after its job returned, so the file is incomplete.
+   * Fail the close and don't move the temporary file over the original. */
+  if (handle->write_error)
+    {
+      g_clear_error (&error);
+      error = g_error_copy (handle->write_error);
+      res = FALSE;
+    }
+
   if (res)
     {
       if (handle->tempname)
@@ -3221,6 +3501,27 @@ close_write_fstat_reply (GVfsBackendSftp *backend,
                                  G_VFS_JOB (job), handle);
 }
 
+static void write_wait (GVfsBackendSftp *backend,
+                        SftpHandle *handle,
+                        GVfsJob *job,
+                        int max_req,
+                        WriteFlushedCallback callback);
+
+static void
+close_write_flushed (GVfsBackendSftp *backend,
+                     SftpHandle *handle,
+                     GVfsJob *job)
+{
+  GDataOutputStream *command;
+
+  command = new_command_stream (backend, SSH_FXP_FSTAT);
+  put_data_buffer (command, handle->raw_handle);
+
+  queue_command_stream_and_free (&backend->command_connection, command,
+                                 close_write_fstat_reply,
+                                 job, handle);
+}
+
 static gboolean
 try_close_write (GVfsBackend *backend,
                  GVfsJobCloseWrite *job,
@@ -3228,14 +3529,9 @@ try_close_write (GVfsBackend *backend,
 {
   SftpHandle *handle = _handle;
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
-
-  command = new_command_stream (op_backend, SSH_FXP_FSTAT);
-  put_data_buffer (command, handle->raw_handle);
 
-  queue_command_stream_and_free (&op_backend->command_connection, command,
-                                 close_write_fstat_reply,
-                                 G_VFS_JOB (job), handle);
+  /* Wait for all the writes, so that their errors are reported here */
+  write_wait (op_backend, handle, G_VFS_JOB (job), 0, close_write_flushed);
 
   return TRUE;
 }
@@ -3270,6 +3566,9 @@ try_close_read (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
 
+  /* Outstanding readahead replies are thrown away */
+  read_window_reset (handle);
+
   command = new_command_stream (op_backend, SSH_FXP_CLOSE);
   put_data_buffer (command, handle->raw_handle);
 
@@ -3394,7 +3693,7 @@ create_reply (GVfsBackendSftp *backend,
       return;
     }
 
-  handle = sftp_handle_new (reply);
+  handle = sftp_handle_new (backend, reply);
   
   g_vfs_job_open_for_write_set_handle (G_VFS_JOB_OPEN_FOR_WRITE (job), handle);
   g_vfs_job_open_for_write_set_can_seek (G_VFS_JOB_OPEN_FOR_WRITE (job), TRUE);
@@ -3478,7 +3777,7 @@ append_to_reply (GVfsBackendSftp *backend,
       return;
     }
 
-  handle = sftp_handle_new (reply);
+  handle = sftp_handle_new (backend, reply);
   
   g_vfs_job_open_for_write_set_handle (G_VFS_JOB_OPEN_FOR_WRITE (job), handle);
   g_vfs_job_open_for_write_set_can_seek (G_VFS_JOB_OPEN_FOR_WRITE (job), TRUE);
@@ -3566,7 +3865,7 @@ replace_truncate_original_reply (GVfsBackendSftp *backend,
       return;
     }
 
-  handle = sftp_handle_new (reply);
+  handle = sftp_handle_new (backend, reply);
   handle->filename = g_strdup (op_job->filename);
   handle->tempname = NULL;
   handle->permissions = data->permissions;
@@ -3668,7 +3967,7 @@ replace_create_temp_reply (GVfsBackendSftp *backend,
       return;
     }
 
-  handle = sftp_handle_new (reply);
+  handle = sftp_handle_new (backend, reply);
   handle->filename = g_strdup (op_job->filename);
   handle->tempname = g_strdup (data->tempname);
   handle->permissions = data->permissions;
@@ -3890,7 +4189,7 @@ replace_exclusive_reply (GVfsBackendSftp *backend,
       return;
     }
   
-  handle = sftp_handle_new (reply);
+  handle = sftp_handle_new (backend, reply);
   
   g_vfs_job_open_for_write_set_handle (op_job, handle);
   g_vfs_job_open_for_write_set_can_seek (op_job, TRUE);
@@ -3923,6 +4222,27 @@ try_replace (GVfsBackend *backend,
   return TRUE;
 }
 
+/* Run callback once no more than max_req writes are outstanding */
+static void
+write_wait (GVfsBackendSftp *backend,
+            SftpHandle *handle,
+            GVfsJob *job,
+            int max_req,
+            WriteFlushedCallback callback)
+{
+  if (handle->write_num_req <= max_req)
+    {
+      callback (backend, handle, job);
+      return;
+    }
+
+  g_assert (handle->write_job == NULL);
+
+  handle->write_job = g_object_ref (job);
+  handle->write_job_max_req = max_req;
+  handle->write_job_callback = callback;
+}
+
 static void
 write_reply (GVfsBackendSftp *backend,
              int reply_type,
@@ -3932,19 +4252,50 @@ write_reply (GVfsBackendSftp *backend,
              gpointer user_data)
 {
   SftpHandle *handle;
-  
+  GVfsJob *waiting_job;
+  GError *error;
+
   handle = user_data;
+  handle->write_num_req--;
 
+  /* The write job has usually returned already, so keep the first error
+   * around and report it on the next write or on close. */
+  error = NULL;
   if (reply_type == SSH_FXP_STATUS)
+    error_from_status (job, reply, -1, -1, &error);
+  else
+    g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         _("Invalid reply received"));
+
+  if (error)
     {
-      if (result_from_status (job, reply, -1, -1))
-        {
-          handle->offset += G_VFS_JOB_WRITE (job)->written_size;
-        }
+      if (handle->write_error == NULL)
+        handle->write_error = error;
+      else
+        g_error_free (error);
     }
+
+  if (handle->write_job != NULL &&
+      handle->write_num_req <= handle->write_job_max_req)
+    {
+      waiting_job = handle->write_job;
+      handle->write_job = NULL;
+      handle->write_job_callback (backend, handle, waiting_job);
+      g_object_unref (waiting_job);
+    }
+}
+
+/* The error stays set until the handle is closed, all later operations
+ * on the handle fail with it. */
+static void
+write_window_flushed (GVfsBackendSftp *backend,
+                      SftpHandle *handle,
+                      GVfsJob *job)
+{
+  if (handle->write_error)
+    g_vfs_job_failed_from_error (job, handle->write_error);
   else
-    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                      _("Invalid reply received"));
+    g_vfs_job_succeeded (job);
 }
 
 static gboolean
@@ -3959,6 +4310,12 @@ try_write (GVfsBackend *backend,
   GDataOutputStream *command;
   gsize size;
 
+  if (handle->write_error)
+    {
+      g_vfs_job_failed_from_error (G_VFS_JOB (job), handle->write_error);
+      return TRUE;
+    }
+
   size = MIN (buffer_size, MAX_BUFFER_SIZE);
 
   command = new_command_stream (op_backend,
@@ -3976,9 +4333,17 @@ try_write (GVfsBackend *backend,
                                  write_reply,
                                  G_VFS_JOB (job), handle);
 
+  handle->offset += size;
+  handle->write_num_req++;
+
   /* We always write the full size (on success) */
   g_vfs_job_write_set_written_size (job, size);
 
+  /* Don't wait for the server to acknowledge the write, unless there are
+   * too many writes outstanding already. Errors are reported later. */
+  write_wait (op_backend, handle, G_VFS_JOB (job),
+              WRITE_MAX_REQUESTS - 1, write_window_flushed);
+
   return TRUE;
 }
 
@@ -4027,17 +4392,20 @@ seek_write_fstat_reply (GVfsBackendSftp *backend,
   g_vfs_job_succeeded (job);
 }
 
-static gboolean
-try_seek_on_write (GVfsBackend *backend,
-                   GVfsJobSeekWrite *job,
-                   GVfsBackendHandle _handle,
-                   goffset    offset,
-                   GSeekType  type)
+static void
+seek_write_flushed (GVfsBackendSftp *op_backend,
+                    SftpHandle *handle,
+                    GVfsJob *_job)
 {
-  SftpHandle *handle = _handle;
-  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  GVfsJobSeekWrite *job = G_VFS_JOB_SEEK_WRITE (_job);
   GDataOutputStream *command;
 
+  if (handle->write_error)
+    {
+      g_vfs_job_failed_from_error (_job, handle->write_error);
+      return;
+    }
+
   switch (job->seek_type)
     {
     case G_SEEK_CUR:
@@ -4053,7 +4421,7 @@ try_seek_on_write (GVfsBackend *backend,
       queue_command_stream_and_free (&op_backend->command_connection, command,
                                      seek_write_fstat_reply,
                                      G_VFS_JOB (job), handle);
-      return TRUE;
+      return;
     }
 
   if (handle->offset < 0)
@@ -4061,6 +4429,20 @@ try_seek_on_write (GVfsBackend *backend,
 
   g_vfs_job_seek_write_set_offset (job, handle->offset);
   g_vfs_job_succeeded (G_VFS_JOB (job));
+}
+
+static gboolean
+try_seek_on_write (GVfsBackend *backend,
+                   GVfsJobSeekWrite *job,
+                   GVfsBackendHandle _handle,
+                   goffset    offset,
+                   GSeekType  type)
+{
+  SftpHandle *handle = _handle;
+
+  /* handle->offset runs ahead of the acknowledged writes */
+  write_wait (G_VFS_BACKEND_SFTP (backend), handle, G_VFS_JOB (job),
+              0, seek_write_flushed);
 
   return TRUE;
 }
@@ -4080,23 +4462,39 @@ truncate_reply (GVfsBackendSftp *backend,
                       _("Invalid reply received"));
 }
 
-static gboolean
-try_truncate (GVfsBackend *backend,
-              GVfsJobTruncate *job,
-              GVfsBackendHandle _handle,
-              goffset size)
+static void
+truncate_flushed (GVfsBackendSftp *op_backend,
+                  SftpHandle *handle,
+                  GVfsJob *job)
 {
-  SftpHandle *handle = _handle;
-  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
 
+  if (handle->write_error)
+    {
+      g_vfs_job_failed_from_error (job, handle->write_error);
+      return;
+    }
+
   command = new_command_stream (op_backend, SSH_FXP_FSETSTAT);
   put_data_buffer (command, handle->raw_handle);
   g_data_output_stream_put_uint32 (command, SSH_FILEXFER_ATTR_SIZE, NULL, NULL);
-  g_data_output_stream_put_uint64 (command, size, NULL, NULL);
+  g_data_output_stream_put_uint64 (command, G_VFS_JOB_TRUNCATE (job)->size, NULL, NULL);
   queue_command_stream_and_free (&op_backend->command_connection, command,
                                  truncate_reply,
-                                 G_VFS_JOB (job), NULL);
+                                 job, NULL);
+}
+
+static gboolean
+try_truncate (GVfsBackend *backend,
+              GVfsJobTruncate *job,
+              GVfsBackendHandle _handle,
+              goffset size)
+{
+  SftpHandle *handle = _handle;
+
+  /* Outstanding writes could extend the file again after the truncate */
+  write_wait (G_VFS_BACKEND_SFTP (backend), handle, G_VFS_JOB (job),
+              0, truncate_flushed);
 
   return TRUE;
 }
@@ -4706,6 +5104,33 @@ try_query_info_fstat (GVfsBackend *backend,
   return TRUE;
 }
 
+static void
+query_info_write_flushed (GVfsBackendSftp *backend,
+                          SftpHandle *handle,
+                          GVfsJob *job)
+{
+  GVfsJobQueryInfoWrite *op_job = G_VFS_JOB_QUERY_INFO_WRITE (job);
+
+  try_query_info_fstat (G_VFS_BACKEND (backend), job, handle,
+                        op_job->file_info, op_job->attribute_matcher);
+}
+
+static gboolean
+try_query_info_on_write (GVfsBackend *backend,
+                         GVfsJobQueryInfoWrite *job,
+                         GVfsBackendHandle _handle,
+                         GFileInfo *info,
+                         GFileAttributeMatcher *attribute_matcher)
+{
+  SftpHandle *handle = _handle;
+
+  /* Report the size including everything written so far */
+  write_wait (G_VFS_BACKEND_SFTP (backend), handle, G_VFS_JOB (job),
+              0, query_info_write_flushed);
+
+  return TRUE;
+}
+
 static void
 move_reply (GVfsBackendSftp *backend,
             int reply_type,
@@ -6634,7 +7059,7 @@ g_vfs_backend_sftp_class_init (GVfsBackendSftpClass *klass)
   backend_class->try_query_info = try_query_info;
   backend_class->try_query_fs_info = try_query_fs_info;
   backend_class->try_query_info_on_read = (gpointer) try_query_info_fstat;
-  backend_class->try_query_info_on_write = (gpointer) try_query_info_fstat;
+  backend_class->try_query_info_on_write = try_query_info_on_write;
   backend_class->try_enumerate = try_enumerate;
   backend_class->try_create = try_create;
   backend_class->try_append_to = try_append_to;
@@ -29,6 +29,10 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <fcntl.h>
+#include <poll.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
 #include <glib.h>
 #include <glib-object.h>
@@ -52,6 +56,18 @@ G_DEFINE_TYPE_WITH_CODE (GVfsChannel, g_vfs_channel, G_TYPE_OBJECT,
 /* TODO: Real P_() */
 #define P_(_x) (_x)
 
+/* Job buffers are recycled in power of two size classes, so sustained
+ * reads and writes don't malloc, free and page fault a fresh buffer for
+ * every request. Each class has room for a reply header on top, so a
+ * power of two read still fits its own class. The largest class fits
+ * the client's 4 MiB maximum read. */
+#define BUFFER_MIN_SHIFT 12
+#define BUFFER_MAX_SHIFT 22
+#define BUFFER_N_CLASSES (BUFFER_MAX_SHIFT - BUFFER_MIN_SHIFT + 1)
+#define BUFFER_CLASS_SIZE(class) ((((gsize) 1) << ((class) + BUFFER_MIN_SHIFT)) + \
+                                  G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE)
+#define BUFFER_POOL_MAX_SIZE (8 * 1024 * 1024)
+
 enum {
   PROP_0,
   PROP_BACKEND,
@@ -106,6 +122,20 @@ struct _GVfsChannelPrivate
   char *output_data_free;
   gsize output_data_size;
   gsize output_data_pos;
+
+  /* If not -1, output_data_size bytes at output_fd_offset of this file
+   * are sent after the reply header, see g_vfs_channel_send_reply_from_fd() */
+  int output_fd;
+  goffset output_fd_offset;
+
+  /* Free buffers are linked through their first bytes */
+  GMutex buffer_lock;
+  gpointer free_buffers[BUFFER_N_CLASSES];
+  gsize free_buffers_size;
+  gsize buffers_in_use;
+  gsize buffers_high_water;
+  guint buffer_allocs;
+  guint buffer_reuses;
 };
 
 static void start_request_reader       (GVfsChannel  *channel);
@@ -123,6 +153,7 @@ static void
 g_vfs_channel_finalize (GObject *object)
 {
   GVfsChannel *channel;
+  int i;
 
   channel = G_VFS_CHANNEL (object);
 
@@ -147,6 +178,23 @@ g_vfs_channel_finalize (GObject *object)
 
   if (channel->priv->backend)
     g_object_unref (channel->priv->backend);
+
+  if (channel->priv->buffer_allocs > 0)
+    g_debug ("channel %p buffers: %u allocated, %u reused, high water %"G_GSIZE_FORMAT" bytes\n",
+             channel, channel->priv->buffer_allocs, channel->priv->buffer_reuses,
+             channel->priv->buffers_high_water);
+
+  for (i = 0; i < BUFFER_N_CLASSES; i++)
+    {
+      while (channel->priv->free_buffers[i] != NULL)
+        {
+          gpointer buffer = channel->priv->free_buffers[i];
+
+          channel->priv->free_buffers[i] = *(gpointer *)buffer;
+          g_free (buffer);
+        }
+    }
+  g_mutex_clear (&channel->priv->buffer_lock);
   
   if (G_OBJECT_CLASS (g_vfs_channel_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_vfs_channel_parent_class)->finalize) (object);
@@ -199,6 +247,8 @@ g_vfs_channel_init (GVfsChannel *channel)
 					       G_VFS_TYPE_CHANNEL,
 					       GVfsChannelPrivate);
   channel->priv->remote_fd = -1;
+  channel->priv->output_fd = -1;
+  g_mutex_init (&channel->priv->buffer_lock);
 
   ret = socketpair (AF_UNIX, SOCK_STREAM, 0, socket_fds);
   if (ret == -1) 
@@ -295,8 +345,8 @@ request_reader_free (RequestReader *reader)
 {
   g_object_unref (reader->command_stream);
   g_object_unref (reader->cancellable);
+  g_vfs_channel_free_buffer (reader->channel, reader->data, reader->data_len);
   g_object_unref (reader->channel);
-  g_free (reader->data);
   g_free (reader);
 }
 
@@ -337,7 +387,7 @@ start_queued_request (GVfsChannel *channel)
 	  job = NULL;
 	  error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_CLOSED,
 	                               _("Channel blocked"));
-	  g_free (req->data);
+	  g_vfs_channel_free_buffer (channel, req->data, req->data_len);
 	}
 
       if (job != NULL && req->cancelled)
@@ -406,7 +456,7 @@ got_request (GVfsChannel *channel,
 	}
 
       /* Cancel ops get no return */
-      g_free (data);
+      g_vfs_channel_free_buffer (channel, data, data_len);
       return;
     }
   
@@ -521,7 +571,7 @@ command_read_cb (GObject *source_object,
 
   if (data_len > 0)
     {
-      reader->data = g_malloc (data_len);
+      reader->data = g_vfs_channel_alloc_buffer (reader->channel, data_len);
       reader->data_len = data_len;
       reader->data_pos = 0;
 
@@ -553,6 +603,9 @@ start_request_reader (GVfsChannel *channel)
 			     command_read_cb, reader);
 }
 
+static void send_reply_done (GVfsChannel *channel);
+static void send_reply_from_fd (GVfsChannel *channel);
+
 static void
 send_reply_cb (GObject *source_object,
 	       GAsyncResult *res,
@@ -561,15 +614,14 @@ send_reply_cb (GObject *source_object,
   GOutputStream *output_stream = G_OUTPUT_STREAM (source_object);
   gssize bytes_written;
   GVfsChannel *channel = user_data;
-  GVfsChannelClass *class;
-  GVfsJob *job;
 
   bytes_written = g_output_stream_write_finish (output_stream, res, NULL);
   
   if (bytes_written <= 0)
     {
       g_vfs_channel_connection_closed (channel);
-      goto error_out;
+      send_reply_done (channel);
+      return;
     }
 
   if (channel->priv->reply_buffer_pos < G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE)
@@ -591,6 +643,12 @@ send_reply_cb (GObject *source_object,
 
   channel->priv->output_data_pos += bytes_written;
 
+  if (channel->priv->output_fd != -1)
+    {
+      send_reply_from_fd (channel);
+      return;
+    }
+
   /* Write more of output_data if needed */
   if (channel->priv->output_data != NULL &&
       channel->priv->output_data_pos < channel->priv->output_data_size)
@@ -603,9 +661,17 @@ send_reply_cb (GObject *source_object,
       return;
     }
 
- error_out:
-  
+  send_reply_done (channel);
+}
+
+static void
+send_reply_done (GVfsChannel *channel)
+{
+  GVfsChannelClass *class;
+  GVfsJob *job;
+
   /* Sent full reply */
+  channel->priv->output_fd = -1;
   if (channel->priv->output_data_free)
     {
       g_free (channel->priv->output_data_free);
@@ -648,6 +714,120 @@ send_reply_cb (GObject *source_object,
   g_object_unref (job);
 }
 
+static gboolean
+wait_writable (int fd)
+{
+  struct pollfd pfd = { fd, POLLOUT, 0 };
+
+  return poll (&pfd, 1, -1) >= 0 || errno == EINTR;
+}
+
+/* Copies the file range to the socket, in a worker thread as the
+ * copy may block. The size was checked right before the reply header
+ * went out; if the file still got shorter the announced number of
+ * bytes can't be sent, so the copy fails and the channel is closed. */
+static void
+send_fd_thread (GTask        *task,
+                gpointer      source_object,
+                gpointer      task_data,
+                GCancellable *cancellable)
+{
+  GVfsChannel *channel = source_object;
+  int out_fd;
+  goffset offset;
+  gsize left;
+#ifndef HAVE_SYS_SENDFILE_H
+  char buffer[65536];
+  gsize buffer_len = 0, buffer_pos = 0;
+#endif
+
+  out_fd = g_unix_output_stream_get_fd (G_UNIX_OUTPUT_STREAM (channel->priv->reply_stream));
+  offset = channel->priv->output_fd_offset;
+  left = channel->priv->output_data_size;
+
+  while (left > 0)
+    {
+      ssize_t res;
+
+#ifdef HAVE_SYS_SENDFILE_H
+      off_t off = offset;
+
+      res = sendfile (out_fd, channel->priv->output_fd, &off, left);
+      if (res == 0)
+        {
+          g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                   "File shrank while reading");
+          return;
+        }
+#else
+      if (buffer_pos == buffer_len)
+        {
+          res = pread (channel->priv->output_fd, buffer,
+                       MIN (left, sizeof (buffer)), offset);
+          if (res == 0)
+            {
+              g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                       "File shrank while reading");
+              return;
+            }
+          if (res < 0 && errno == EINTR)
+            continue;
+          if (res < 0)
+            break;
+
+          buffer_len = res;
+          buffer_pos = 0;
+        }
+
+      res = write (out_fd, buffer + buffer_pos, buffer_len - buffer_pos);
+      if (res > 0)
+        buffer_pos += res;
+#endif
+
+      if (res < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno == EAGAIN && wait_writable (out_fd))
+            continue;
+          break;
+        }
+
+      offset += res;
+      left -= res;
+    }
+
+  if (left > 0)
+    g_task_return_new_error (task, G_IO_ERROR,
+                             g_io_error_from_errno (errno),
+                             "%s", g_strerror (errno));
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+send_fd_cb (GObject      *source_object,
+            GAsyncResult *res,
+            gpointer      user_data)
+{
+  GVfsChannel *channel = G_VFS_CHANNEL (source_object);
+
+  if (!g_task_propagate_boolean (G_TASK (res), NULL))
+    g_vfs_channel_connection_closed (channel);
+
+  send_reply_done (channel);
+}
+
+static void
+send_reply_from_fd (GVfsChannel *channel)
+{
+  GTask *task;
+
+  task = g_task_new (channel, NULL, send_fd_cb, NULL);
+  g_task_run_in_thread (task, send_fd_thread);
+  g_object_unref (task);
+}
+
 /* Might be called on an i/o thread */
 void
 g_vfs_channel_send_reply (GVfsChannel *channel,
@@ -682,6 +862,23 @@ g_vfs_channel_send_reply (GVfsChannel *channel,
     }
 }
 
+/* Might be called on an i/o thread
+ * Sends data_len bytes of the regular file fd, starting at offset, after
+ * the reply header without copying them through the daemon. fd must stay
+ * open until the job has finished.
+ */
+void
+g_vfs_channel_send_reply_from_fd (GVfsChannel *channel,
+                                  GVfsDaemonSocketProtocolReply *reply,
+                                  int fd,
+                                  goffset offset,
+                                  gsize data_len)
+{
+  channel->priv->output_fd = fd;
+  channel->priv->output_fd_offset = offset;
+  g_vfs_channel_send_reply (channel, reply, NULL, data_len);
+}
+
 /* Might be called on an i/o thread */
 void
 g_vfs_channel_send_reply_take (GVfsChannel *channel,
@@ -767,12 +964,21 @@ g_vfs_channel_get_actual_consumer (GVfsChannel *channel)
 }
 
 static void
-free_queued_requests (gpointer data)
+free_queued_requests (GVfsChannel *channel)
 {
-  Request *req = (Request *) data;
+  GList *l;
 
-  g_free (req->data);
-  g_free (req);
+  for (l = channel->priv->queued_requests; l != NULL; l = l->next)
+    {
+      Request *req = l->data;
+
+      /* The data comes from the buffer pool */
+      g_vfs_channel_free_buffer (channel, req->data, req->data_len);
+      g_free (req);
+    }
+
+  g_list_free (channel->priv->queued_requests);
+  channel->priv->queued_requests = NULL;
 }
 
 void
@@ -790,8 +996,92 @@ g_vfs_channel_force_close (GVfsChannel *channel)
   if (job)
     g_vfs_job_cancel (job);
 
-  g_list_free_full (channel->priv->queued_requests, free_queued_requests);
-  channel->priv->queued_requests = NULL;
+  free_queued_requests (channel);
 
   g_vfs_job_source_closed (G_VFS_JOB_SOURCE (channel));
 }
+
+static int
+buffer_class (gsize size)
+{
+  int class;
+
+  if (size > BUFFER_CLASS_SIZE (BUFFER_N_CLASSES - 1))
+    return -1;
+
+  for (class = 0; BUFFER_CLASS_SIZE (class) < size; class++)
+    ;
+
+  return class;
+}
+
+/* Might be called on an i/o thread
+ * Returns a buffer of at least size bytes, which must be released with
+ * g_vfs_channel_free_buffer().
+ */
+gpointer
+g_vfs_channel_alloc_buffer (GVfsChannel *channel,
+                            gsize        size)
+{
+  GVfsChannelPrivate *priv = channel->priv;
+  gpointer buffer;
+  int class;
+
+  class = buffer_class (size);
+  if (class < 0)
+    return g_malloc (size);
+
+  g_mutex_lock (&priv->buffer_lock);
+  buffer = priv->free_buffers[class];
+  if (buffer != NULL)
+    {
+      priv->free_buffers[class] = *(gpointer *)buffer;
+      priv->free_buffers_size -= BUFFER_CLASS_SIZE (class);
+      priv->buffer_reuses++;
+    }
+  else
+    priv->buffer_allocs++;
+  priv->buffers_in_use += BUFFER_CLASS_SIZE (class);
+  priv->buffers_high_water = MAX (priv->buffers_high_water, priv->buffers_in_use);
+  g_mutex_unlock (&priv->buffer_lock);
+
+  if (buffer == NULL)
+    buffer = g_malloc (BUFFER_CLASS_SIZE (class));
+
+  return buffer;
+}
+
+/* Might be called on an i/o thread
+ * size must be the size the buffer was allocated with.
+ */
+void
+g_vfs_channel_free_buffer (GVfsChannel *channel,
+                           gpointer     buffer,
+                           gsize        size)
+{
+  GVfsChannelPrivate *priv = channel->priv;
+  int class;
+
+  if (buffer == NULL)
+    return;
+
+  class = buffer_class (size);
+  if (class < 0)
+    {
+      g_free (buffer);
+      return;
+    }
+
+  g_mutex_lock (&priv->buffer_lock);
+  priv->buffers_in_use -= BUFFER_CLASS_SIZE (class);
+  if (priv->free_buffers_size + BUFFER_CLASS_SIZE (class) <= BUFFER_POOL_MAX_SIZE)
+    {
+      *(gpointer *)buffer = priv->free_buffers[class];
+      priv->free_buffers[class] = buffer;
+      priv->free_buffers_size += BUFFER_CLASS_SIZE (class);
+      buffer = NULL;
+    }
+  g_mutex_unlock (&priv->buffer_lock);
+
+  g_free (buffer);
+}
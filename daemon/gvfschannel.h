@@ -86,9 +86,19 @@ void              g_vfs_channel_send_reply_take    (GVfsChannel
                                                     GVfsDaemonSocketProtocolReply *reply,
                                                     void                          *data,
                                                     gsize                          data_len);
+void              g_vfs_channel_send_reply_from_fd (GVfsChannel                   *channel,
+                                                    GVfsDaemonSocketProtocolReply *reply,
+                                                    int                            fd,
+                                                    goffset                        offset,
+                                                    gsize                          data_len);
 guint32           g_vfs_channel_get_current_seq_nr (GVfsChannel                   *channel);
 GPid              g_vfs_channel_get_actual_consumer (GVfsChannel                  *channel);
 void              g_vfs_channel_force_close        (GVfsChannel                   *channel);
+gpointer          g_vfs_channel_alloc_buffer       (GVfsChannel                   *channel,
+                                                    gsize                          size);
+void              g_vfs_channel_free_buffer        (GVfsChannel                   *channel,
+                                                    gpointer                       buffer,
+                                                    gsize                          size);
 /* TODO: i/o priority? */
 
 G_END_DECLS
@@ -43,6 +43,9 @@
 #include <gvfsjobopenforread.h>
 #include <gvfsjobopenforwrite.h>
 #include <gvfsjobunmount.h>
+#include <gvfsjobpull.h>
+#include <gvfsjobpush.h>
+#include <gvfsjobcopy.h>
 #include <gvfsmonitorimpl.h>
 
 enum {
@@ -70,6 +73,12 @@ struct _GVfsDaemon
   gboolean main_daemon;
 
   GThreadPool *thread_pool;
+  gint max_threads;
+  /* Long running transfer jobs (pull, push, copy) are limited to
+   * max_threads - 1 workers, so that they can't starve short requests
+   * like query_info or enumerate. Protected by lock. */
+  gint bulk_jobs_running;
+  GQueue bulk_jobs_pending;
   GHashTable *registered_paths;
   GHashTable *client_connections;
   GList *jobs;
@@ -174,6 +183,7 @@ g_vfs_daemon_finalize (GObject *object)
   
   g_hash_table_destroy (daemon->registered_paths);
   g_hash_table_destroy (daemon->client_connections);
+  g_queue_clear (&daemon->bulk_jobs_pending);
   g_mutex_clear (&daemon->lock);
 
   if (G_OBJECT_CLASS (g_vfs_daemon_parent_class)->finalize)
@@ -199,13 +209,66 @@ g_vfs_daemon_class_init (GVfsDaemonClass *klass)
 		  G_TYPE_NONE, 0);
 }
 
+static gboolean
+job_is_bulk (GVfsJob *job)
+{
+  return G_VFS_IS_JOB_PULL (job) ||
+         G_VFS_IS_JOB_PUSH (job) ||
+         G_VFS_IS_JOB_COPY (job);
+}
+
+/* Must be called with daemon->lock held */
+static void
+push_job_locked (GVfsDaemon *daemon,
+                 GVfsJob    *job)
+{
+  GError *error;
+
+  if (job_is_bulk (job))
+    {
+      if (daemon->max_threads > 1 &&
+          daemon->bulk_jobs_running >= daemon->max_threads - 1)
+        {
+          g_debug ("Deferring bulk job %p (%s)\n", job, g_type_name_from_instance ((gpointer)job));
+          g_queue_push_tail (&daemon->bulk_jobs_pending, job);
+          return;
+        }
+
+      daemon->bulk_jobs_running++;
+    }
+
+  error = NULL;
+  if (!g_thread_pool_push (daemon->thread_pool, job, &error))
+    {
+      g_warning ("Error pushing job to the thread pool: %s (%s, %d)\n",
+                 error->message, g_quark_to_string (error->domain), error->code);
+      g_error_free (error);
+    }
+}
+
 static void
 job_handler_callback (gpointer       data,
 		      gpointer       user_data)
 {
   GVfsJob *job = G_VFS_JOB (data);
+  GVfsDaemon *daemon = G_VFS_DAEMON (user_data);
+  GVfsJob *pending;
+  gboolean is_bulk;
+
+  /* The job may be gone once it has run */
+  is_bulk = job_is_bulk (job);
 
   g_vfs_job_run (job);
+
+  if (is_bulk)
+    {
+      g_mutex_lock (&daemon->lock);
+      daemon->bulk_jobs_running--;
+      pending = g_queue_pop_head (&daemon->bulk_jobs_pending);
+      if (pending)
+        push_job_locked (daemon, pending);
+      g_mutex_unlock (&daemon->lock);
+    }
 }
 
 static void
@@ -240,14 +303,21 @@ static void
 g_vfs_daemon_init (GVfsDaemon *daemon)
 {
   GError *error;
-  gint max_threads = 1; /* TODO: handle max threads */
 
+  /* Backends are not thread-safe by default, the real limit is set by
+   * g_vfs_daemon_set_max_threads() once the backend type is known */
+  daemon->max_threads = 1;
+  daemon->bulk_jobs_running = 0;
+  g_queue_init (&daemon->bulk_jobs_pending);
+
+  error = NULL;
   daemon->thread_pool = g_thread_pool_new (job_handler_callback,
 					   daemon,
-					   max_threads,
-					   FALSE, NULL);
-  /* TODO: verify thread_pool != NULL in a nicer way */
-  g_assert (daemon->thread_pool != NULL);
+					   daemon->max_threads,
+					   FALSE, &error);
+  if (daemon->thread_pool == NULL)
+    g_error ("Error creating the job thread pool: %s (%s, %d)\n",
+             error->message, g_quark_to_string (error->domain), error->code);
 
   g_mutex_init (&daemon->lock);
 
@@ -365,7 +435,29 @@ void
 g_vfs_daemon_set_max_threads (GVfsDaemon                    *daemon,
 			      gint                           max_threads)
 {
-  g_thread_pool_set_max_threads (daemon->thread_pool, max_threads, NULL);
+  GError *error;
+  GVfsJob *pending;
+
+  if (max_threads < 1)
+    max_threads = 1;
+
+  error = NULL;
+  if (!g_thread_pool_set_max_threads (daemon->thread_pool, max_threads, &error))
+    {
+      g_warning ("Error setting max threads: %s (%s, %d)\n",
+                 error->message, g_quark_to_string (error->domain), error->code);
+      g_error_free (error);
+      return;
+    }
+
+  g_mutex_lock (&daemon->lock);
+  daemon->max_threads = max_threads;
+
+  /* Release deferred bulk jobs if the limit was raised */
+  while ((max_threads == 1 || daemon->bulk_jobs_running < max_threads - 1) &&
+         (pending = g_queue_pop_head (&daemon->bulk_jobs_pending)) != NULL)
+    push_job_locked (daemon, pending);
+  g_mutex_unlock (&daemon->lock);
 }
 
 static gboolean
@@ -597,7 +689,7 @@ g_vfs_daemon_queue_job (GVfsDaemon *daemon,
   if (!g_vfs_job_try (job))
     {
       /* Couldn't finish / run async, queue worker thread */
-      g_thread_pool_push (daemon->thread_pool, job, NULL); /* TODO: Check error */
+      g_vfs_daemon_run_job_in_thread (daemon, job);
     }
 }
 
@@ -1113,7 +1205,9 @@ void
 g_vfs_daemon_run_job_in_thread (GVfsDaemon *daemon,
 				GVfsJob    *job)
 {
-  g_thread_pool_push (daemon->thread_pool, job, NULL); /* TODO: Check error */
+  g_mutex_lock (&daemon->lock);
+  push_job_locked (daemon, job);
+  g_mutex_unlock (&daemon->lock);
 }
 
 void
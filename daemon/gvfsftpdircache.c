@@ -21,6 +21,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 
 #include <config.h>
@@ -35,6 +36,12 @@ struct _GVfsFtpDirCacheEntry
 {
   GHashTable *          files;          /* GVfsFtpFile => GFileInfo mapping */
   guint                 stamp;          /* cache's stamp when this entry was created */
+  gint64                created;        /* monotonic time when this entry was created */
+  gsize                 size;           /* estimated memory used by files */
+  const GVfsFtpFile *   dir;            /* key in the cache's hash table, if cached */
+  GList *               lru_link;       /* link in the cache's LRU queue, if cached */
+  GVfsFtpDirCacheFunc   add_func;       /* called for every file added while listing */
+  gpointer              add_data;
   volatile int          refcount;       /* need to refount this struct for thread safety */
 };
 
@@ -49,6 +56,8 @@ g_vfs_ftp_dir_cache_entry_new (guint stamp)
                                         (GDestroyNotify) g_vfs_ftp_file_free,
                                         g_object_unref);
   entry->stamp = stamp;
+  entry->created = g_get_monotonic_time ();
+  entry->size = sizeof (GVfsFtpDirCacheEntry);
   entry->refcount = 1;
 
   return entry;
@@ -72,6 +81,46 @@ g_vfs_ftp_dir_cache_entry_unref (GVfsFtpDirCacheEntry *entry)
   g_slice_free (GVfsFtpDirCacheEntry, entry);
 }
 
+/* This is only a rough estimate of the memory used by the info, which is
+ * good enough to keep the size of the cache bounded. */
+static gsize
+g_vfs_ftp_dir_cache_estimate_info_size (GFileInfo *info)
+{
+  char **attributes;
+  const char *s;
+  gsize size;
+  guint i;
+
+  /* object, attribute array and hash table node */
+  size = 128;
+
+  attributes = g_file_info_list_attributes (info, NULL);
+  for (i = 0; attributes[i] != NULL; i++)
+    {
+      size += 2 * sizeof (gpointer) + sizeof (guint64);
+
+      switch (g_file_info_get_attribute_type (info, attributes[i]))
+        {
+        case G_FILE_ATTRIBUTE_TYPE_STRING:
+          s = g_file_info_get_attribute_string (info, attributes[i]);
+          size += s ? strlen (s) + 1 : 0;
+          break;
+        case G_FILE_ATTRIBUTE_TYPE_BYTE_STRING:
+          s = g_file_info_get_attribute_byte_string (info, attributes[i]);
+          size += s ? strlen (s) + 1 : 0;
+          break;
+        case G_FILE_ATTRIBUTE_TYPE_OBJECT:
+          size += 64;
+          break;
+        default:
+          break;
+        }
+    }
+  g_strfreev (attributes);
+
+  return size;
+}
+
 /**
  * g_vfs_ftp_dir_cache_entry_add:
  * @entry: the entry to add data to
@@ -89,7 +138,13 @@ g_vfs_ftp_dir_cache_entry_add (GVfsFtpDirCacheEntry *entry, GVfsFtpFile *file, G
   g_return_if_fail (file != NULL);
   g_return_if_fail (G_IS_FILE_INFO (info));
 
+  entry->size += strlen (g_vfs_ftp_file_get_ftp_path (file)) +
+                 strlen (g_vfs_ftp_file_get_gvfs_path (file)) +
+                 g_vfs_ftp_dir_cache_estimate_info_size (info);
   g_hash_table_insert (entry->files, file, info);
+
+  if (entry->add_func)
+    entry->add_func (file, info, entry->add_data);
 }
 
 /*** CACHE ***/
@@ -97,6 +152,13 @@ g_vfs_ftp_dir_cache_entry_add (GVfsFtpDirCacheEntry *entry, GVfsFtpFile *file, G
 struct _GVfsFtpDirCache
 {
   GHashTable *          directories;    /* GVfsFtpFile of directory => GVfsFtpDirCacheEntry mapping */
+  GQueue                lru;            /* cached entries, most recently used first */
+  gsize                 size;           /* sum of the sizes of the cached entries */
+  gsize                 max_size;       /* evict entries when size grows above this */
+  gint64                ttl;            /* microseconds until an entry expires, 0 for never */
+  guint                 hits;           /* statistics for debugging */
+  guint                 misses;
+  guint                 evictions;
   guint                 stamp;          /* used to identify validity of cache when flushing */
   GMutex                lock;           /* mutex for thread safety of stamp and hash table */
   const GVfsFtpDirFuncs *funcs;         /* functions to call */
@@ -114,6 +176,9 @@ g_vfs_ftp_dir_cache_new (const GVfsFtpDirFuncs *funcs)
                                               g_vfs_ftp_file_equal,
                                               (GDestroyNotify) g_vfs_ftp_file_free,
                                               (GDestroyNotify) g_vfs_ftp_dir_cache_entry_unref);
+  g_queue_init (&cache->lru);
+  cache->max_size = G_VFS_FTP_DIR_CACHE_DEFAULT_MAX_SIZE;
+  cache->ttl = G_VFS_FTP_DIR_CACHE_DEFAULT_TTL * G_USEC_PER_SEC;
   g_mutex_init (&cache->lock);
   cache->funcs = funcs;
 
@@ -125,28 +190,153 @@ g_vfs_ftp_dir_cache_free (GVfsFtpDirCache *cache)
 {
   g_return_if_fail (cache != NULL);
 
+  g_debug ("# dir cache: %u hits, %u misses, %u evictions, %" G_GSIZE_FORMAT " bytes\n",
+           cache->hits, cache->misses, cache->evictions, cache->size);
+
+  g_queue_clear (&cache->lru);
   g_hash_table_destroy (cache->directories);
   g_mutex_clear (&cache->lock);
   g_slice_free (GVfsFtpDirCache, cache);
 }
 
+/* Must be called with cache->lock held */
+static void
+g_vfs_ftp_dir_cache_remove_locked (GVfsFtpDirCache *     cache,
+                                   GVfsFtpDirCacheEntry *entry)
+{
+  const GVfsFtpFile *dir;
+
+  g_queue_delete_link (&cache->lru, entry->lru_link);
+  entry->lru_link = NULL;
+  cache->size -= entry->size;
+  dir = entry->dir;
+  entry->dir = NULL;
+  /* drops the cache's reference of entry and frees the key */
+  g_hash_table_remove (cache->directories, dir);
+}
+
+/* Must be called with cache->lock held */
+static void
+g_vfs_ftp_dir_cache_evict_locked (GVfsFtpDirCache *cache)
+{
+  GVfsFtpDirCacheEntry *entry;
+
+  /* Always keep the most recently used directory */
+  while (cache->size > cache->max_size &&
+         cache->lru.length > 1)
+    {
+      entry = g_queue_peek_tail (&cache->lru);
+      g_debug ("# dir cache: evicting %s (%" G_GSIZE_FORMAT " bytes)\n",
+               g_vfs_ftp_file_get_gvfs_path (entry->dir), entry->size);
+      g_vfs_ftp_dir_cache_remove_locked (cache, entry);
+      cache->evictions++;
+    }
+}
+
+/* Must be called with cache->lock held */
+static void
+g_vfs_ftp_dir_cache_insert_locked (GVfsFtpDirCache *     cache,
+                                   const GVfsFtpFile *   dir,
+                                   GVfsFtpDirCacheEntry *entry)
+{
+  GVfsFtpDirCacheEntry *old;
+  GVfsFtpFile *key;
+
+  old = g_hash_table_lookup (cache->directories, dir);
+  if (old)
+    g_vfs_ftp_dir_cache_remove_locked (cache, old);
+
+  key = g_vfs_ftp_file_copy (dir);
+  entry->dir = key;
+  g_hash_table_insert (cache->directories,
+                       key,
+                       g_vfs_ftp_dir_cache_entry_ref (entry));
+  g_queue_push_head (&cache->lru, entry);
+  entry->lru_link = cache->lru.head;
+  cache->size += entry->size;
+
+  g_vfs_ftp_dir_cache_evict_locked (cache);
+}
+
+/**
+ * g_vfs_ftp_dir_cache_set_limits:
+ * @cache: the cache
+ * @max_size: approximate number of bytes the cached directories may use
+ * @ttl: seconds after which a cached directory is listed again, or 0 to
+ *       keep directories until they are purged
+ *
+ * Changes the limits of @cache. If the cache is too big afterwards, the
+ * least recently used directories are evicted.
+ **/
+void
+g_vfs_ftp_dir_cache_set_limits (GVfsFtpDirCache *cache,
+                                gsize            max_size,
+                                guint            ttl)
+{
+  g_return_if_fail (cache != NULL);
+
+  g_mutex_lock (&cache->lock);
+  cache->max_size = max_size;
+  cache->ttl = (gint64) ttl * G_USEC_PER_SEC;
+  g_vfs_ftp_dir_cache_evict_locked (cache);
+  g_mutex_unlock (&cache->lock);
+}
+
+/* Must be called with cache->lock held */
+static gboolean
+g_vfs_ftp_dir_cache_entry_is_valid_locked (GVfsFtpDirCache *     cache,
+                                           GVfsFtpDirCacheEntry *entry,
+                                           guint                 stamp)
+{
+  if (entry->stamp < stamp)
+    return FALSE;
+
+  if (cache->ttl > 0 &&
+      g_get_monotonic_time () - entry->created > cache->ttl)
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Returns a reference to the cached entry for dir, or NULL if there is none
+ * or it is too old. */
 static GVfsFtpDirCacheEntry *
-g_vfs_ftp_dir_cache_lookup_entry (GVfsFtpDirCache *  cache,
-                                  GVfsFtpTask *      task,
-                                  const GVfsFtpFile *dir,
-                                  guint              stamp)
+g_vfs_ftp_dir_cache_get_cached_entry (GVfsFtpDirCache *  cache,
+                                      const GVfsFtpFile *dir,
+                                      guint              stamp)
 {
   GVfsFtpDirCacheEntry *entry;
 
   g_mutex_lock (&cache->lock);
   entry = g_hash_table_lookup (cache->directories, dir);
-  if (entry)
-    g_vfs_ftp_dir_cache_entry_ref (entry);
+  if (entry && g_vfs_ftp_dir_cache_entry_is_valid_locked (cache, entry, stamp))
+    {
+      g_vfs_ftp_dir_cache_entry_ref (entry);
+      g_queue_unlink (&cache->lru, entry->lru_link);
+      g_queue_push_head_link (&cache->lru, entry->lru_link);
+      cache->hits++;
+    }
+  else
+    {
+      entry = NULL;
+      cache->misses++;
+    }
   g_mutex_unlock (&cache->lock);
-  if (entry && entry->stamp < stamp)
-    g_vfs_ftp_dir_cache_entry_unref (entry);
-  else if (entry)
-    return entry;
+
+  return entry;
+}
+
+/* Lists dir from the server and caches the result. If func is given, it is
+ * called for every file as soon as its line was parsed. */
+static GVfsFtpDirCacheEntry *
+g_vfs_ftp_dir_cache_list_entry (GVfsFtpDirCache *   cache,
+                                GVfsFtpTask *       task,
+                                const GVfsFtpFile * dir,
+                                guint               stamp,
+                                GVfsFtpDirCacheFunc func,
+                                gpointer            user_data)
+{
+  GVfsFtpDirCacheEntry *entry;
 
   if (g_vfs_ftp_task_send (task,
         	           G_VFS_FTP_PASS_550,
@@ -165,12 +355,16 @@ g_vfs_ftp_dir_cache_lookup_entry (GVfsFtpDirCache *  cache,
     return NULL;
 
   entry = g_vfs_ftp_dir_cache_entry_new (stamp);
+  entry->add_func = func;
+  entry->add_data = user_data;
   cache->funcs->process (g_io_stream_get_input_stream (g_vfs_ftp_connection_get_data_stream (task->conn)),
                          g_vfs_ftp_connection_get_debug_id (task->conn),
                          dir,
                          entry,
                          task->cancellable,
                          &task->error);
+  entry->add_func = NULL;
+  entry->add_data = NULL;
   g_vfs_ftp_task_close_data_connection (task);
   g_vfs_ftp_task_receive (task, 0, NULL);
   if (g_vfs_ftp_task_is_in_error (task))
@@ -179,13 +373,26 @@ g_vfs_ftp_dir_cache_lookup_entry (GVfsFtpDirCache *  cache,
       return NULL;
     }
   g_mutex_lock (&cache->lock);
-  g_hash_table_insert (cache->directories,
-                       g_vfs_ftp_file_copy (dir),
-                       g_vfs_ftp_dir_cache_entry_ref (entry));
+  g_vfs_ftp_dir_cache_insert_locked (cache, dir, entry);
   g_mutex_unlock (&cache->lock);
   return entry;
 }
 
+static GVfsFtpDirCacheEntry *
+g_vfs_ftp_dir_cache_lookup_entry (GVfsFtpDirCache *  cache,
+                                  GVfsFtpTask *      task,
+                                  const GVfsFtpFile *dir,
+                                  guint              stamp)
+{
+  GVfsFtpDirCacheEntry *entry;
+
+  entry = g_vfs_ftp_dir_cache_get_cached_entry (cache, dir, stamp);
+  if (entry)
+    return entry;
+
+  return g_vfs_ftp_dir_cache_list_entry (cache, task, dir, stamp, NULL, NULL);
+}
+
 static GFileInfo *
 g_vfs_ftp_dir_cache_lookup_file_internal (GVfsFtpDirCache *  cache,
                                           GVfsFtpTask *      task,
@@ -383,15 +590,127 @@ g_vfs_ftp_dir_cache_lookup_dir (GVfsFtpDirCache *  cache,
   return result;
 }
 
+typedef struct {
+  GVfsFtpDirCacheFunc   func;
+  gpointer              user_data;
+  gboolean              resolve_symlinks;
+  GList *               symlinks;       /* GVfsFtpFile => GFileInfo pairs to resolve later */
+} EnumerateData;
+
+static void
+g_vfs_ftp_dir_cache_enumerate_add (GVfsFtpFile *file,
+                                   GFileInfo *  info,
+                                   gpointer     user_data)
+{
+  EnumerateData *data = user_data;
+
+  /* Resolving needs the control connection, which is busy until the
+   * listing is complete */
+  if (data->resolve_symlinks && g_file_info_get_is_symlink (info))
+    {
+      data->symlinks = g_list_prepend (data->symlinks, g_object_ref (info));
+      data->symlinks = g_list_prepend (data->symlinks, g_vfs_ftp_file_copy (file));
+      return;
+    }
+
+  data->func (file, info, data->user_data);
+}
+
+/**
+ * g_vfs_ftp_dir_cache_enumerate_dir:
+ * @cache: the cache
+ * @task: the task to use for network operations
+ * @dir: the directory to enumerate
+ * @flush: %TRUE to always list the directory from the server
+ * @resolve_symlinks: %TRUE to report the targets of symlinks
+ * @func: function to call for every file in @dir
+ * @user_data: data to pass to @func
+ *
+ * Like g_vfs_ftp_dir_cache_lookup_dir(), but instead of returning all files
+ * at once, @func is called for every file as soon as it is known. When the
+ * directory is listed from the server, this is while the listing is still
+ * being received, so @func may have been called before an error occurs.
+ * Symlinks are only reported once the listing is complete.
+ **/
+void
+g_vfs_ftp_dir_cache_enumerate_dir (GVfsFtpDirCache *   cache,
+                                   GVfsFtpTask *       task,
+                                   const GVfsFtpFile * dir,
+                                   gboolean            flush,
+                                   gboolean            resolve_symlinks,
+                                   GVfsFtpDirCacheFunc func,
+                                   gpointer            user_data)
+{
+  GVfsFtpDirCacheEntry *entry;
+  EnumerateData data = { func, user_data, resolve_symlinks, NULL };
+  GHashTableIter iter;
+  gpointer file, info;
+  GList *walk;
+  guint stamp;
+
+  g_return_if_fail (cache != NULL);
+  g_return_if_fail (task != NULL);
+  g_return_if_fail (dir != NULL);
+  g_return_if_fail (func != NULL);
+
+  if (g_vfs_ftp_task_is_in_error (task))
+    return;
+
+  if (flush)
+    {
+      g_mutex_lock (&cache->lock);
+      g_assert (cache->stamp != G_MAXUINT);
+      stamp = ++cache->stamp;
+      g_mutex_unlock (&cache->lock);
+    }
+  else
+    stamp = 0;
+
+  entry = g_vfs_ftp_dir_cache_get_cached_entry (cache, dir, stamp);
+  if (entry)
+    {
+      g_hash_table_iter_init (&iter, entry->files);
+      while (g_hash_table_iter_next (&iter, &file, &info))
+        g_vfs_ftp_dir_cache_enumerate_add (file, info, &data);
+    }
+  else
+    entry = g_vfs_ftp_dir_cache_list_entry (cache, task, dir, stamp,
+                                            g_vfs_ftp_dir_cache_enumerate_add,
+                                            &data);
+
+  for (walk = data.symlinks; walk; walk = walk->next->next)
+    {
+      file = walk->data;
+      info = walk->next->data;
+
+      if (entry)
+        {
+          info = g_vfs_ftp_dir_cache_resolve_symlink (cache, task, file, info, stamp);
+          func (file, info, user_data);
+        }
+
+      g_object_unref (info);
+      g_vfs_ftp_file_free (file);
+    }
+  g_list_free (data.symlinks);
+
+  if (entry)
+    g_vfs_ftp_dir_cache_entry_unref (entry);
+}
+
 void
 g_vfs_ftp_dir_cache_purge_dir (GVfsFtpDirCache *  cache,
                                const GVfsFtpFile *dir)
 {
+  GVfsFtpDirCacheEntry *entry;
+
   g_return_if_fail (cache != NULL);
   g_return_if_fail (dir != NULL);
 
   g_mutex_lock (&cache->lock);
-  g_hash_table_remove (cache->directories, dir);
+  entry = g_hash_table_lookup (cache->directories, dir);
+  if (entry)
+    g_vfs_ftp_dir_cache_remove_locked (cache, entry);
   g_mutex_unlock (&cache->lock);
 }
 
@@ -28,11 +28,19 @@
 
 G_BEGIN_DECLS
 
+/* Directories are listed again after the TTL expired, and the least
+ * recently used ones are dropped once the cache grows beyond its size. */
+#define G_VFS_FTP_DIR_CACHE_DEFAULT_MAX_SIZE (16 * 1024 * 1024)
+#define G_VFS_FTP_DIR_CACHE_DEFAULT_TTL 300 /* seconds */
 
 //typedef struct _GVfsFtpDirCache GVfsFtpDirCache;
 typedef struct _GVfsFtpDirCacheEntry GVfsFtpDirCacheEntry;
 //typedef struct _GVfsFtpDirFuncs GVfsFtpDirFuncs;
 
+typedef void            (* GVfsFtpDirCacheFunc)                 (GVfsFtpFile *          file,
+                                                                 GFileInfo *            info,
+                                                                 gpointer               user_data);
+
 struct _GVfsFtpDirFuncs {
   const char *          command;
   gboolean              (* process)                             (GInputStream *         stream,
@@ -53,6 +61,9 @@ extern const GVfsFtpDirFuncs g_vfs_ftp_dir_cache_funcs_default;
 
 GVfsFtpDirCache *       g_vfs_ftp_dir_cache_new                 (const GVfsFtpDirFuncs *funcs);
 void                    g_vfs_ftp_dir_cache_free                (GVfsFtpDirCache *      cache);
+void                    g_vfs_ftp_dir_cache_set_limits          (GVfsFtpDirCache *      cache,
+                                                                 gsize                  max_size,
+                                                                 guint                  ttl);
 
 GFileInfo *             g_vfs_ftp_dir_cache_lookup_file         (GVfsFtpDirCache *      cache,
                                                                  GVfsFtpTask *          task,
@@ -63,6 +74,13 @@ GList *                 g_vfs_ftp_dir_cache_lookup_dir          (GVfsFtpDirCache
                                                                  const GVfsFtpFile *    dir,
                                                                  gboolean               flush,
                                                                  gboolean               resolve_symlinks);
+void                    g_vfs_ftp_dir_cache_enumerate_dir       (GVfsFtpDirCache *      cache,
+                                                                 GVfsFtpTask *          task,
+                                                                 const GVfsFtpFile *    dir,
+                                                                 gboolean               flush,
+                                                                 gboolean               resolve_symlinks,
+                                                                 GVfsFtpDirCacheFunc    func,
+                                                                 gpointer               user_data);
 void                    g_vfs_ftp_dir_cache_purge_file          (GVfsFtpDirCache *      cache,
                                                                  const GVfsFtpFile *    file);
 void                    g_vfs_ftp_dir_cache_purge_dir           (GVfsFtpDirCache *      cache,
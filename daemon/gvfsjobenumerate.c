@@ -35,6 +35,14 @@
 
 G_DEFINE_TYPE (GVfsJobEnumerate, g_vfs_job_enumerate, G_VFS_TYPE_JOB_DBUS)
 
+/* Infos are sent in batches that start small, so the first files show up
+ * quickly, and grow for large directories to save D-Bus messages. A batch
+ * is also sent once it gets too big or too old. */
+#define BATCH_MIN_INFOS 50
+#define BATCH_MAX_INFOS 2000
+#define BATCH_MAX_SIZE (512 * 1024)
+#define BATCH_MAX_AGE_MS 200
+
 static void         run        (GVfsJob        *job);
 static gboolean     try        (GVfsJob        *job);
 static void         send_reply   (GVfsJob        *job);
@@ -54,6 +62,8 @@ g_vfs_job_enumerate_finalize (GObject *object)
   g_file_attribute_matcher_unref (job->attribute_matcher);
   g_free (job->object_path);
   g_free (job->uri);
+  g_clear_object (&job->enumerator_proxy);
+  g_mutex_clear (&job->building_infos_lock);
   
   if (G_OBJECT_CLASS (g_vfs_job_enumerate_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_vfs_job_enumerate_parent_class)->finalize) (object);
@@ -76,6 +86,8 @@ g_vfs_job_enumerate_class_init (GVfsJobEnumerateClass *klass)
 static void
 g_vfs_job_enumerate_init (GVfsJobEnumerate *job)
 {
+  job->max_building_infos = BATCH_MIN_INFOS;
+  g_mutex_init (&job->building_infos_lock);
 }
 
 gboolean 
@@ -119,6 +131,9 @@ create_enumerator_proxy (GVfsJobEnumerate *job)
   const gchar *sender;
   GVfsDBusEnumerator *proxy;
 
+  if (job->enumerator_proxy != NULL)
+    return g_object_ref (job->enumerator_proxy);
+
   connection = g_dbus_method_invocation_get_connection (G_VFS_JOB_DBUS (job)->invocation);
   sender = g_dbus_method_invocation_get_sender (G_VFS_JOB_DBUS (job)->invocation);
 
@@ -130,6 +145,7 @@ create_enumerator_proxy (GVfsJobEnumerate *job)
                                                NULL);
   g_assert (proxy != NULL);
   g_dbus_proxy_set_default_timeout (G_DBUS_PROXY (proxy), G_MAXINT);
+  job->enumerator_proxy = g_object_ref (proxy);
 
   return proxy;
 }
@@ -150,11 +166,19 @@ send_infos_cb (GVfsDBusEnumerator *proxy,
     }
 }
 
+/* Call with building_infos_lock held */
 static void
 send_infos (GVfsJobEnumerate *job)
 {
   GVfsDBusEnumerator *proxy;
 
+  if (job->building_infos_timeout != NULL)
+    {
+      g_source_destroy (job->building_infos_timeout);
+      g_source_unref (job->building_infos_timeout);
+      job->building_infos_timeout = NULL;
+    }
+
   proxy = create_enumerator_proxy (job);
   
   gvfs_dbus_enumerator_call_got_info (proxy,
@@ -167,6 +191,25 @@ send_infos (GVfsJobEnumerate *job)
   g_variant_builder_unref (job->building_infos);
   job->building_infos = NULL;
   job->n_building_infos = 0;
+  job->building_infos_size = 0;
+
+  /* The directory is large, so use fewer and bigger batches */
+  job->max_building_infos = MIN (job->max_building_infos * 2, BATCH_MAX_INFOS);
+}
+
+/* Sends a partial batch if the backend stalls before filling it */
+static gboolean
+building_infos_timeout_cb (gpointer user_data)
+{
+  GVfsJobEnumerate *job = user_data;
+
+  g_mutex_lock (&job->building_infos_lock);
+  if (job->building_infos != NULL &&
+      job->building_infos_timeout == g_main_current_source ())
+    send_infos (job);
+  g_mutex_unlock (&job->building_infos_lock);
+
+  return G_SOURCE_REMOVE;
 }
 
 void
@@ -175,12 +218,6 @@ g_vfs_job_enumerate_add_info (GVfsJobEnumerate *job,
 {
   char *uri, *escaped_name;
   GVariant *v;
-  
-  if (job->building_infos == NULL)
-    {
-      job->building_infos = g_variant_builder_new (G_VARIANT_TYPE ("aa(suv)"));
-      job->n_building_infos = 0;
-    }
 
   uri = NULL;
   if (job->uri != NULL &&
@@ -202,11 +239,32 @@ g_vfs_job_enumerate_add_info (GVfsJobEnumerate *job,
   g_file_info_set_attribute_mask (info, job->attribute_matcher);
 
   v = _g_dbus_append_file_info (info);
+
+  /* Backends may add infos from a thread while the timeout fires */
+  g_mutex_lock (&job->building_infos_lock);
+
+  if (job->building_infos == NULL)
+    {
+      job->building_infos = g_variant_builder_new (G_VARIANT_TYPE ("aa(suv)"));
+      job->n_building_infos = 0;
+      job->building_infos_size = 0;
+
+      job->building_infos_timeout = g_timeout_source_new (BATCH_MAX_AGE_MS);
+      g_source_set_callback (job->building_infos_timeout,
+                             building_infos_timeout_cb,
+                             g_object_ref (job), g_object_unref);
+      g_source_attach (job->building_infos_timeout, NULL);
+    }
+
+  job->building_infos_size += g_variant_get_size (v);
   g_variant_builder_add_value (job->building_infos, v);
   job->n_building_infos++;
 
-  if (job->n_building_infos == 50)
+  if (job->n_building_infos >= job->max_building_infos ||
+      job->building_infos_size >= BATCH_MAX_SIZE)
     send_infos (job);
+
+  g_mutex_unlock (&job->building_infos_lock);
 }
 
 void
@@ -246,10 +304,11 @@ g_vfs_job_enumerate_done (GVfsJobEnumerate *job)
   
   g_assert (!G_VFS_JOB (job)->failed);
 
+  g_mutex_lock (&job->building_infos_lock);
   if (job->building_infos != NULL)
     send_infos (job);
-
   proxy = create_enumerator_proxy (job);
+  g_mutex_unlock (&job->building_infos_lock);
   
   gvfs_dbus_enumerator_call_done (proxy,
                                   NULL,
@@ -260,6 +319,57 @@ g_vfs_job_enumerate_done (GVfsJobEnumerate *job)
   g_vfs_job_emit_finished (G_VFS_JOB (job));
 }
 
+static void
+send_failed_cb (GVfsDBusEnumerator *proxy,
+                GAsyncResult *res,
+                gpointer user_data)
+{
+  GError *error = NULL;
+
+  gvfs_dbus_enumerator_call_failed_finish (proxy, res, &error);
+  if (error != NULL)
+    {
+      g_dbus_error_strip_remote_error (error);
+      g_debug ("send_failed_cb: %s (%s, %d)\n", error->message, g_quark_to_string (error->domain), error->code);
+      g_error_free (error);
+
+      /* The client doesn't know about Failed, at least end the listing */
+      gvfs_dbus_enumerator_call_done (proxy,
+                                      NULL,
+                                      (GAsyncReadyCallback) send_done_cb,
+                                      NULL);
+    }
+}
+
+/* For backends that already replied to the job, but then fail to list the
+   whole directory. The client gets the infos sent so far and then the error,
+   rather than a listing that looks complete. */
+void
+g_vfs_job_enumerate_done_with_error (GVfsJobEnumerate *job,
+                                     const GError *error)
+{
+  GVfsDBusEnumerator *proxy;
+
+  g_assert (G_VFS_JOB (job)->sent_reply && !G_VFS_JOB (job)->failed);
+
+  g_mutex_lock (&job->building_infos_lock);
+  if (job->building_infos != NULL)
+    send_infos (job);
+  proxy = create_enumerator_proxy (job);
+  g_mutex_unlock (&job->building_infos_lock);
+
+  gvfs_dbus_enumerator_call_failed (proxy,
+                                    g_quark_to_string (error->domain),
+                                    error->code,
+                                    error->message,
+                                    NULL,
+                                    (GAsyncReadyCallback) send_failed_cb,
+                                    NULL);
+  g_object_unref (proxy);
+
+  g_vfs_job_emit_finished (G_VFS_JOB (job));
+}
+
 static void
 run (GVfsJob *job)
 {
@@ -53,6 +53,11 @@ struct _GVfsJobEnumerate
 
   GVariantBuilder *building_infos;
   int n_building_infos;
+  int max_building_infos;
+  gsize building_infos_size;
+  GSource *building_infos_timeout;
+  GMutex building_infos_lock;
+  GVfsDBusEnumerator *enumerator_proxy;
 };
 
 struct _GVfsJobEnumerateClass
@@ -76,6 +81,8 @@ void     g_vfs_job_enumerate_add_info   (GVfsJobEnumerate      *job,
 void     g_vfs_job_enumerate_add_infos  (GVfsJobEnumerate      *job,
 					 const GList           *info);
 void     g_vfs_job_enumerate_done       (GVfsJobEnumerate      *job);
+void     g_vfs_job_enumerate_done_with_error (GVfsJobEnumerate *job,
+                                              const GError     *error);
 
 G_END_DECLS
 
@@ -23,7 +23,9 @@
 #include <config.h>
 
 #include <unistd.h>
+#include <string.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
@@ -32,6 +34,7 @@
 #include "gvfsreadchannel.h"
 #include "gvfsjobread.h"
 #include "gvfsdaemonutils.h"
+#include "gvfsdaemonprotocol.h"
 
 G_DEFINE_TYPE (GVfsJobRead, g_vfs_job_read, G_VFS_TYPE_JOB)
 
@@ -46,8 +49,10 @@ g_vfs_job_read_finalize (GObject *object)
 
   job = G_VFS_JOB_READ (object);
 
+  g_vfs_channel_free_buffer (G_VFS_CHANNEL (job->channel),
+                             job->buffer - G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE,
+                             G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE + job->bytes_requested);
   g_object_unref (job->channel);
-  g_free (job->buffer);
   
   if (G_OBJECT_CLASS (g_vfs_job_read_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_vfs_job_read_parent_class)->finalize) (object);
@@ -69,6 +74,7 @@ g_vfs_job_read_class_init (GVfsJobReadClass *klass)
 static void
 g_vfs_job_read_init (GVfsJobRead *job)
 {
+  job->data_fd = -1;
 }
 
 GVfsJob *
@@ -85,7 +91,11 @@ g_vfs_job_read_new (GVfsReadChannel *channel,
   job->backend = backend;
   job->channel = g_object_ref (channel);
   job->handle = handle;
-  job->buffer = g_malloc (bytes_requested);
+  /* Leave room for the reply header in front of the data, so the reply
+   * can be sent with a single write */
+  job->buffer = (char *)g_vfs_channel_alloc_buffer (G_VFS_CHANNEL (channel),
+                                                    G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE + bytes_requested) +
+                G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE;
   job->bytes_requested = bytes_requested;
   
   return G_VFS_JOB (job);
@@ -103,6 +113,13 @@ send_reply (GVfsJob *job)
 
   if (job->failed)
     g_vfs_channel_send_error (G_VFS_CHANNEL (op_job->channel), job->error);
+  else if (op_job->data_fd != -1)
+    {
+      g_vfs_read_channel_send_data_from_fd (op_job->channel,
+					    op_job->data_fd,
+					    op_job->data_fd_offset,
+					    op_job->data_count);
+    }
   else
     {
       g_vfs_read_channel_send_data (op_job->channel,
@@ -155,3 +172,34 @@ g_vfs_job_read_set_size (GVfsJobRead *job,
 {
   job->data_count = data_size;
 }
+
+/* For backends reading from a local file: if fd is a regular file, the
+ * data at its current position is sent to the client by the kernel
+ * instead of being read into the job buffer, and the file position is
+ * advanced past it. fd must stay open until the job has finished.
+ * Returns FALSE if the caller has to read the data itself. */
+gboolean
+g_vfs_job_read_set_from_fd (GVfsJobRead *job,
+			    int fd)
+{
+  struct stat statbuf;
+  off_t pos;
+  gsize count;
+
+  if (fstat (fd, &statbuf) != 0 || !S_ISREG (statbuf.st_mode))
+    return FALSE;
+
+  pos = lseek (fd, 0, SEEK_CUR);
+  if (pos < 0 || pos >= statbuf.st_size)
+    return FALSE;
+
+  count = MIN (job->bytes_requested, statbuf.st_size - pos);
+  if (lseek (fd, pos + count, SEEK_SET) < 0)
+    return FALSE;
+
+  job->data_fd = fd;
+  job->data_fd_offset = pos;
+  job->data_count = count;
+
+  return TRUE;
+}
@@ -46,8 +46,12 @@ struct _GVfsJobRead
   GVfsBackend *backend;
   GVfsBackendHandle handle;
   gsize bytes_requested;
-  char *buffer;
+  char *buffer; /* preceded by room for the reply header */
   gsize data_count;
+
+  /* If not -1, the data is sent from this file instead of buffer */
+  int data_fd;
+  goffset data_fd_offset;
 };
 
 struct _GVfsJobReadClass
@@ -63,6 +67,8 @@ GVfsJob *g_vfs_job_read_new        (GVfsReadChannel   *channel,
 				    GVfsBackend       *backend);
 void     g_vfs_job_read_set_size   (GVfsJobRead       *job,
 				    gsize              data_size);
+gboolean g_vfs_job_read_set_from_fd (GVfsJobRead      *job,
+				    int                fd);
 
 G_END_DECLS
 
@@ -46,8 +46,8 @@ g_vfs_job_write_finalize (GObject *object)
 
   job = G_VFS_JOB_WRITE (object);
 
+  g_vfs_channel_free_buffer (G_VFS_CHANNEL (job->channel), job->data, job->data_size);
   g_object_unref (job->channel);
-  g_free (job->data);
   
   if (G_OBJECT_CLASS (g_vfs_job_write_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_vfs_job_write_parent_class)->finalize) (object);
@@ -24,9 +24,11 @@
 
 #include <unistd.h>
 #include <errno.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 
 #include <glib.h>
@@ -41,12 +43,26 @@
 #include <gvfsjobcloseread.h>
 #include <gvfsfileinfo.h>
 
+/* Upper bound on the data sent ahead of the client when streaming, this
+ * is what the client may have to skip over after a seek. */
+#define READAHEAD_MAX_BYTES (4 * 1024 * 1024)
+#define READAHEAD_MAX_DEPTH 64
+
 struct _GVfsReadChannel
 {
   GVfsChannel parent_instance;
 
   guint read_count;
   int seek_generation;
+
+  /* Number of READ requests from the client since the last seek. Unlike
+   * read_count, this doesn't include readahead. */
+  guint client_read_count;
+
+  /* Number of readahead blocks sent since the last seek. Every client
+   * request is answered with exactly one block, so this is also the
+   * number of blocks the client has not asked for yet. */
+  guint readahead_depth;
 };
 
 G_DEFINE_TYPE (GVfsReadChannel, g_vfs_read_channel, G_VFS_TYPE_CHANNEL)
@@ -160,6 +176,7 @@ read_channel_handle_request (GVfsChannel *channel,
     {
     case G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_READ:
       read_channel->read_count++;
+      read_channel->client_read_count++;
       job = g_vfs_job_read_new (read_channel,
 				backend_handle,
 				modify_read_size (read_channel, arg1),
@@ -177,6 +194,8 @@ read_channel_handle_request (GVfsChannel *channel,
 	seek_type = G_SEEK_END;
       
       read_channel->read_count = 0;
+      read_channel->client_read_count = 0;
+      read_channel->readahead_depth = 0;
       read_channel->seek_generation++;
       job = g_vfs_job_seek_read_new (read_channel,
 				     backend_handle,
@@ -203,10 +222,34 @@ read_channel_handle_request (GVfsChannel *channel,
     }
 
   /* Ownership was passed */
-  g_free (data);
+  g_vfs_channel_free_buffer (channel, data, data_len);
   return job;
 }
 
+/* Allow one block ahead after the second sequential read, then double
+ * the number of blocks every two client reads while the client keeps
+ * streaming, as long as the data in flight fits in READAHEAD_MAX_BYTES.
+ * Only client requests count, finished readaheads must not raise the
+ * limit they are checked against. */
+static guint
+readahead_max_depth (GVfsReadChannel *channel,
+                     gsize            block_size)
+{
+  guint depth;
+  guint shift;
+
+  if (channel->client_read_count < 2)
+    return 0;
+
+  shift = MIN ((channel->client_read_count - 2) / 2, 6);
+  depth = MIN (1 << shift, READAHEAD_MAX_DEPTH);
+
+  if (block_size > 0)
+    depth = MIN (depth, MAX (READAHEAD_MAX_BYTES / block_size, 1));
+
+  return depth;
+}
+
 static GVfsJob *
 read_channel_readahead (GVfsChannel  *channel,
 			GVfsJob       *job)
@@ -214,6 +257,7 @@ read_channel_readahead (GVfsChannel  *channel,
   GVfsJob *readahead_job;
   GVfsReadChannel *read_channel;
   GVfsJobRead *read_job;
+  guint32 size;
 
   readahead_job = NULL;
   if (!job->failed &&
@@ -233,14 +277,25 @@ read_channel_readahead (GVfsChannel  *channel,
 	 reading the readahead data, and after that is done
 	 send a new request but start reading the result of the
 	 previous read request. This way the reading will be
-	 fully pipelined. */
+	 fully pipelined.
+
+	 While the client keeps reading sequentially we let the
+	 readahead grow further ahead. The channel still runs one
+	 read job at a time, so this does not make the backend
+	 handle several requests at once; it only buffers more
+	 data on the client side, which hides the time between
+	 two client reads. Backends that benefit from concurrent
+	 requests have to pipeline them themselves. A seek resets
+	 the depth, and reaching EOF stops the readahead. */
+      size = modify_read_size (read_channel, 8192);
       if (read_job->data_count != 0 &&
-	  read_channel->read_count == 2)
+	  read_channel->readahead_depth < readahead_max_depth (read_channel, size))
 	{
 	  read_channel->read_count++;
+	  read_channel->readahead_depth++;
 	  readahead_job = g_vfs_job_read_new (read_channel,
 					      g_vfs_channel_get_backend_handle (channel),
-					      modify_read_size (read_channel, 8192),
+					      size,
 					      g_vfs_channel_get_backend (channel));
 	}
     }
@@ -287,6 +342,8 @@ g_vfs_read_channel_send_closed (GVfsReadChannel *read_channel)
 }
 
 /* Might be called on an i/o thread
+ * buffer must be preceded by G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE
+ * writable bytes, which are used for the reply header.
  */
 void
 g_vfs_read_channel_send_data (GVfsReadChannel  *read_channel,
@@ -295,6 +352,42 @@ g_vfs_read_channel_send_data (GVfsReadChannel  *read_channel,
 {
   GVfsDaemonSocketProtocolReply reply;
   GVfsChannel *channel;
+  struct stat statbuf;
+
+  channel = G_VFS_CHANNEL (read_channel);
+
+  /* The file may have been truncated since the job sized the read,
+   * don't announce more bytes than are there now */
+  if (fstat (fd, &statbuf) == 0)
+    {
+      if (statbuf.st_size <= offset)
+        count = 0;
+      else
+        count = MIN (count, statbuf.st_size - offset);
+    }
+
+  reply.type = g_htonl (G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_DATA);
+  reply.seq_nr = g_htonl (g_vfs_channel_get_current_seq_nr (channel));
+  reply.arg1 = g_htonl (count);
+  reply.arg2 = g_htonl (read_channel->seek_generation);
+
+  buffer -= G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE;
+  memcpy (buffer, &reply, G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE);
+  g_vfs_channel_send_reply (channel, NULL, buffer,
+                            G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE + count);
+}
+
+/* Might be called on an i/o thread
+ * Sends count bytes of the regular file fd, starting at offset.
+ */
+void
+g_vfs_read_channel_send_data_from_fd (GVfsReadChannel  *read_channel,
+				      int               fd,
+				      goffset           offset,
+				      gsize             count)
+{
+  GVfsDaemonSocketProtocolReply reply;
+  GVfsChannel *channel;
 
   channel = G_VFS_CHANNEL (read_channel);
 
@@ -303,7 +396,7 @@ g_vfs_read_channel_send_data (GVfsReadChannel  *read_channel,
   reply.arg1 = g_htonl (count);
   reply.arg2 = g_htonl (read_channel->seek_generation);
 
-  g_vfs_channel_send_reply (channel, &reply, buffer, count);
+  g_vfs_channel_send_reply_from_fd (channel, &reply, fd, offset, count);
 }
 
 
@@ -52,6 +52,10 @@ GVfsReadChannel *g_vfs_read_channel_new                (GVfsBackend        *back
 void            g_vfs_read_channel_send_data          (GVfsReadChannel     *read_channel,
 						       char               *buffer,
 						       gsize               count);
+void            g_vfs_read_channel_send_data_from_fd  (GVfsReadChannel     *read_channel,
+						       int                 fd,
+						       goffset             offset,
+						       gsize               count);
 void            g_vfs_read_channel_send_closed        (GVfsReadChannel     *read_channel);
 void            g_vfs_read_channel_send_seek_offset   (GVfsReadChannel     *read_channel,
 						      goffset             offset);
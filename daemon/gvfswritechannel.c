@@ -161,7 +161,7 @@ write_channel_handle_request (GVfsChannel *channel,
     }
 
   /* Ownership was passed */
-  g_free (data);
+  g_vfs_channel_free_buffer (channel, data, data_len);
   return job;
 }
 
@@ -44,6 +44,7 @@
  *
  */
 
+#include <string.h>
 #include "crc32.h"
 
 static const guint32 crcTable[256] = {
@@ -81,15 +82,62 @@ static const guint32 crcTable[256] = {
   0xB3667A2EUL, 0xC4614AB8UL, 0x5D681B02UL, 0x2A6F2B94UL, 0xB40BBE37UL, 0xC30C8EA1UL, 0x5A05DF1BUL, 0x2D02EF8DUL
 };
 
+/* Tables for slicing-by-8, crcTables[k][i] is the crc of byte i followed
+ * by k zero bytes. crcTables[0] is crcTable. */
+static guint32 crcTables[8][256];
+
+static void
+init_crc_tables (void)
+{
+  int i, k;
+
+  for (i = 0; i < 256; i++)
+    crcTables[0][i] = crcTable[i];
+
+  for (k = 1; k < 8; k++)
+    for (i = 0; i < 256; i++)
+      crcTables[k][i] = (crcTables[k-1][i] >> 8) ^ crcTable[crcTables[k-1][i] & 0xFF];
+}
+
 guint32
 metadata_crc32 (const void *ptr, size_t len)
 {
+  static gsize tables_initialized = 0;
   guint32 crc = 0xFFFFFFFF;
   const guint8 *bp = (const guint8 *) ptr;
-  size_t i;
 
-  for (i=0; i<len; i++)
-    crc = crcTable[(crc ^ bp[i]) & 0xFF] ^ (crc >> 8);
+  if (g_once_init_enter (&tables_initialized))
+    {
+      init_crc_tables ();
+      g_once_init_leave (&tables_initialized, 1);
+    }
+
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+  /* Process 8 bytes at a time */
+  while (len >= 8)
+    {
+      guint32 one, two;
+
+      memcpy (&one, bp, 4);
+      memcpy (&two, bp + 4, 4);
+      one ^= crc;
+
+      crc = crcTables[7][one & 0xFF] ^
+            crcTables[6][(one >> 8) & 0xFF] ^
+            crcTables[5][(one >> 16) & 0xFF] ^
+            crcTables[4][one >> 24] ^
+            crcTables[3][two & 0xFF] ^
+            crcTables[2][(two >> 8) & 0xFF] ^
+            crcTables[1][(two >> 16) & 0xFF] ^
+            crcTables[0][two >> 24];
+
+      bp += 8;
+      len -= 8;
+    }
+#endif
+
+  while (len-- > 0)
+    crc = crcTable[(crc ^ *bp++) & 0xFF] ^ (crc >> 8);
 
   return crc ^ 0xFFFFFFFF;
 }
@@ -0,0 +1,69 @@
+#include "config.h"
+#include "metatree.h"
+#include <time.h>
+#include <glib/gstdio.h>
+
+static char *treename = NULL;
+static gint max_age_days = 0;
+static GOptionEntry entries[] =
+{
+  { "tree", 't', 0, G_OPTION_ARG_STRING, &treename, "Tree", NULL},
+  { "max-age", 'a', 0, G_OPTION_ARG_INT, &max_age_days, "Also drop data older than this many days", NULL},
+  { NULL }
+};
+
+int
+main (int argc,
+      char *argv[])
+{
+  MetaTree *tree;
+  GError *error = NULL;
+  GOptionContext *context;
+  gint64 min_last_changed;
+  guint64 reclaimed;
+
+  context = g_option_context_new ("<tree file> <root dir> - drop metadata of deleted files");
+  g_option_context_add_main_entries (context, entries, GETTEXT_PACKAGE);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("option parsing failed: %s\n", error->message);
+      return 1;
+    }
+
+  if ((treename && argc < 2) || (!treename && argc < 3))
+    {
+      g_printerr ("no root dir specified\n");
+      return 1;
+    }
+
+  if (treename)
+    tree = meta_tree_lookup_by_name (treename, TRUE);
+  else
+    tree = meta_tree_open (argv[1], TRUE);
+
+  if (tree == NULL)
+    {
+      g_printerr ("can't open metadata tree %s\n", treename ? treename : argv[1]);
+      return 1;
+    }
+
+  min_last_changed = 0;
+  if (max_age_days > 0)
+    min_last_changed = time (NULL) - (gint64)max_age_days * 24 * 60 * 60;
+
+  /* The daemon should not be writing to the tree meanwhile */
+  if (!meta_tree_compact (tree, treename ? argv[1] : argv[2],
+			  min_last_changed, &reclaimed, &error))
+    {
+      g_printerr ("Unable to compact tree: %s\n", error->message);
+      g_error_free (error);
+      meta_tree_unref (tree);
+      return 1;
+    }
+
+  g_print ("Reclaimed %" G_GUINT64_FORMAT " bytes\n", reclaimed);
+
+  meta_tree_unref (tree);
+
+  return 0;
+}
@@ -27,6 +27,7 @@
 #include <glib/gstdio.h>
 #include <locale.h>
 #include <stdlib.h>
+#include <time.h>
 #include "metatree.h"
 #include "gvfsdaemonprotocol.h"
 #include "metadata-dbus.h"
@@ -43,6 +44,7 @@
 
 #define WRITEOUT_TIMEOUT_SECS 60
 #define WRITEOUT_TIMEOUT_SECS_NFS 15
+#define COMPACT_TIMEOUT_SECS (10 * 60)
 
 typedef struct {
   char *filename;
@@ -67,12 +69,27 @@ tree_info_free (TreeInfo *info)
   g_free (info);
 }
 
+static void
+writeout_done (GObject      *source_object,
+	       GAsyncResult *result,
+	       gpointer      user_data)
+{
+  GError *error = NULL;
+
+  if (!meta_tree_flush_finish (result, &error))
+    {
+      g_warning ("Failed to write out metadata: %s", error->message);
+      g_error_free (error);
+    }
+}
+
 static gboolean
 writeout_timeout (gpointer data)
 {
   TreeInfo *info = data;
 
-  meta_tree_flush (info->tree);
+  /* The tree is written out in a thread, so that clients aren't blocked */
+  meta_tree_flush_async (info->tree, writeout_done, NULL);
   info->writeout_timeout = 0;
 
   return FALSE;
@@ -145,6 +162,66 @@ tree_info_lookup (const char *filename)
   return info;
 }
 
+static void
+compact_done (GObject      *source_object,
+	      GAsyncResult *result,
+	      gpointer      user_data)
+{
+  char *name = user_data;
+  GError *error = NULL;
+  guint64 reclaimed;
+
+  if (meta_tree_compact_finish (result, &reclaimed, &error))
+    g_debug ("Compacted metadata tree %s, reclaimed %" G_GUINT64_FORMAT " bytes",
+             name, reclaimed);
+  else
+    {
+      g_warning ("Failed to compact metadata tree %s: %s", name, error->message);
+      g_error_free (error);
+    }
+
+  g_free (name);
+}
+
+/* Drops the metadata of deleted files once the session has settled. Only
+   the home tree is compacted, as the others may describe unmounted media. */
+static gboolean
+compact_timeout (gpointer data)
+{
+  TreeInfo *info;
+  char *filename;
+  const char *max_age;
+  gint64 min_last_changed;
+  gint64 now;
+  guint64 days;
+
+  filename = g_build_filename (g_get_user_data_dir (), "gvfs-metadata", "home", NULL);
+  if (g_file_test (filename, G_FILE_TEST_EXISTS))
+    {
+      /* Optionally also forget about files not touched for a long time */
+      min_last_changed = 0;
+      max_age = g_getenv ("GVFS_METADATA_MAX_AGE_DAYS");
+      if (max_age)
+        {
+          /* Anything older than the epoch keeps everything, and
+             avoids overflowing the multiplication */
+          now = time (NULL);
+          days = g_ascii_strtoull (max_age, NULL, 10);
+          days = MIN (days, (guint64) MAX (now, 0) / (24 * 60 * 60));
+          if (days > 0)
+            min_last_changed = now - (gint64) days * 24 * 60 * 60;
+        }
+
+      info = tree_info_lookup (filename);
+      if (info)
+        meta_tree_compact_async (info->tree, g_get_home_dir (), min_last_changed,
+                                 compact_done, g_strdup ("home"));
+    }
+  g_free (filename);
+
+  return FALSE;
+}
+
 static gboolean
 handle_set (GVfsMetadata *object,
             GDBusMethodInvocation *invocation,
@@ -263,6 +340,120 @@ handle_remove (GVfsMetadata *object,
   return TRUE;
 }
 
+/* Same as handle_set(), but for many files at once */
+static gboolean
+handle_set_batch (GVfsMetadata *object,
+                  GDBusMethodInvocation *invocation,
+                  const gchar *arg_treefile,
+                  GVariant *arg_items,
+                  GVfsMetadata *daemon)
+{
+  TreeInfo *info;
+  MetaTreeBatch *batch;
+  const gchar *path;
+  const gchar *key;
+  GVariantIter items_iter;
+  GVariantIter *iter;
+  GVariant *value;
+  gboolean res;
+
+  info = tree_info_lookup (arg_treefile);
+  if (info == NULL)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             G_IO_ERROR,
+                                             G_IO_ERROR_NOT_FOUND,
+                                             _("Can’t find metadata file %s"),
+                                             arg_treefile);
+      return TRUE;
+    }
+
+  batch = meta_tree_batch_new ();
+
+  g_variant_iter_init (&items_iter, arg_items);
+  while (g_variant_iter_next (&items_iter, "(^&aya{sv})", &path, &iter))
+    {
+      while (g_variant_iter_next (iter, "{&sv}", &key, &value))
+        {
+          if (g_variant_is_of_type (value, G_VARIANT_TYPE_STRING_ARRAY))
+            {
+              const gchar **strv;
+
+              strv = g_variant_get_strv (value, NULL);
+              meta_tree_batch_set_stringv (batch, path, key, (gchar **) strv);
+              g_free (strv);
+            }
+          else if (g_variant_is_of_type (value, G_VARIANT_TYPE_STRING))
+            meta_tree_batch_set_string (batch, path, key,
+                                        g_variant_get_string (value, NULL));
+          else if (g_variant_is_of_type (value, G_VARIANT_TYPE_BYTE))
+            meta_tree_batch_unset (batch, path, key);
+          g_variant_unref (value);
+        }
+      g_variant_iter_free (iter);
+    }
+
+  res = meta_tree_apply_batch (info->tree, batch);
+  meta_tree_batch_free (batch);
+
+  /* A failed batch may still be partially applied, as in handle_set() */
+  tree_info_schedule_writeout (info);
+
+  if (!res)
+    g_dbus_method_invocation_return_error_literal (invocation,
+                                                   G_IO_ERROR,
+                                                   G_IO_ERROR_FAILED,
+                                                   _("Unable to set metadata key"));
+  else
+    gvfs_metadata_complete_set_batch (object, invocation);
+
+  return TRUE;
+}
+
+static gboolean
+handle_remove_batch (GVfsMetadata *object,
+                     GDBusMethodInvocation *invocation,
+                     const gchar *arg_treefile,
+                     const gchar *const *arg_paths,
+                     GVfsMetadata *daemon)
+{
+  TreeInfo *info;
+  MetaTreeBatch *batch;
+  gboolean res;
+  int i;
+
+  info = tree_info_lookup (arg_treefile);
+  if (info == NULL)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             G_IO_ERROR,
+                                             G_IO_ERROR_NOT_FOUND,
+                                             _("Can’t find metadata file %s"),
+                                             arg_treefile);
+      return TRUE;
+    }
+
+  batch = meta_tree_batch_new ();
+  for (i = 0; arg_paths[i] != NULL; i++)
+    meta_tree_batch_remove (batch, arg_paths[i]);
+
+  res = meta_tree_apply_batch (info->tree, batch);
+  meta_tree_batch_free (batch);
+
+  /* A failed batch may still be partially applied */
+  tree_info_schedule_writeout (info);
+
+  if (!res)
+    g_dbus_method_invocation_return_error_literal (invocation,
+                                                   G_IO_ERROR,
+                                                   G_IO_ERROR_FAILED,
+                                                   _("Unable to remove metadata keys"));
+  else
+    gvfs_metadata_complete_remove_batch (object, invocation);
+
+  return TRUE;
+}
+
 static gboolean
 handle_move (GVfsMetadata *object,
              GDBusMethodInvocation *invocation,
@@ -443,6 +634,8 @@ main (int argc, char *argv[])
 
   g_signal_connect (skeleton, "handle-set", G_CALLBACK (handle_set), skeleton);
   g_signal_connect (skeleton, "handle-remove", G_CALLBACK (handle_remove), skeleton);
+  g_signal_connect (skeleton, "handle-set-batch", G_CALLBACK (handle_set_batch), skeleton);
+  g_signal_connect (skeleton, "handle-remove-batch", G_CALLBACK (handle_remove_batch), skeleton);
   g_signal_connect (skeleton, "handle-move", G_CALLBACK (handle_move), skeleton);
   g_signal_connect (skeleton, "handle-get-tree-from-device", G_CALLBACK (handle_get_tree_from_device), skeleton);
 
@@ -458,6 +651,8 @@ main (int argc, char *argv[])
       return 1;
     }
 
+  g_timeout_add_seconds (COMPACT_TIMEOUT_SECS, compact_timeout, NULL);
+
   name_owner_id = g_bus_own_name_on_connection (conn,
                                                 G_VFS_DBUS_METADATA_NAME,
                                                 flags,
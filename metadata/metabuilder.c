@@ -48,16 +48,20 @@
 
 
 #define MAJOR_VERSION 1
-#define MINOR_VERSION 0
+#define MINOR_VERSION 1
 #define MAJOR_JOURNAL_VERSION 1
 #define MINOR_JOURNAL_VERSION 0
-#define NEW_JOURNAL_SIZE (32*1024)
+#define DEFAULT_JOURNAL_SIZE (32*1024)
+#define MIN_JOURNAL_SIZE (4*1024)
 
 #define RANDOM_TAG_OFFSET 12
 #define ROTATED_OFFSET 8
 
 #define KEY_IS_LIST_MASK (1<<31)
 
+/* Directories with fewer children are looked up by bsearch only */
+#define CHILD_HASH_MIN_CHILDREN 16
+
 MetaBuilder *
 meta_builder_new (void)
 {
@@ -281,6 +285,90 @@ meta_builder_remove (MetaBuilder *builder,
     }
 }
 
+/* path is the filesystem path of file, and is restored before returning */
+static guint
+metafile_prune_children (MetaFile *file,
+			 GString *path,
+			 gint64 min_last_changed)
+{
+  GSequenceIter *iter, *next;
+  MetaFile *child;
+  struct stat statbuf;
+  gsize path_len;
+  gboolean remove;
+  guint removed;
+
+  removed = 0;
+  path_len = path->len;
+
+  iter = g_sequence_get_begin_iter (file->children);
+  while (!g_sequence_iter_is_end (iter))
+    {
+      next = g_sequence_iter_next (iter);
+      child = g_sequence_get (iter);
+
+      if (path_len == 0 || path->str[path_len - 1] != '/')
+	g_string_append_c (path, '/');
+      g_string_append (path, child->name);
+
+      remove = FALSE;
+      if (g_lstat (path->str, &statbuf) != 0)
+	{
+	  /* Only drop what is surely gone, not what is just unreadable */
+	  remove = (errno == ENOENT || errno == ENOTDIR);
+	}
+      else
+	{
+	  removed += metafile_prune_children (child, path, min_last_changed);
+
+	  if (min_last_changed != 0 &&
+	      child->last_changed != 0 &&
+	      child->last_changed < min_last_changed)
+	    g_sequence_remove_range (g_sequence_get_begin_iter (child->data),
+				     g_sequence_get_end_iter (child->data));
+
+	  remove = child->last_changed < min_last_changed &&
+		   g_sequence_get_length (child->data) == 0 &&
+		   g_sequence_get_length (child->children) == 0;
+	}
+
+      if (remove)
+	{
+	  g_sequence_remove (iter);
+	  removed++;
+	}
+
+      g_string_truncate (path, path_len);
+      iter = next;
+    }
+
+  return removed;
+}
+
+/* Drops the files that don't exist below fs_root anymore, and the data
+ * of files last changed before min_last_changed (unless 0). Returns the
+ * number of removed files.
+ */
+guint
+meta_builder_prune (MetaBuilder *builder,
+		    const char  *fs_root,
+		    gint64       min_last_changed)
+{
+  struct stat statbuf;
+  GString *path;
+  guint removed;
+
+  /* Don't remove everything just because e.g. the home isn't mounted */
+  if (g_stat (fs_root, &statbuf) != 0 ||
+      !S_ISDIR (statbuf.st_mode))
+    return 0;
+
+  path = g_string_new (fs_root);
+  removed = metafile_prune_children (builder->root, path, min_last_changed);
+  g_string_free (path, TRUE);
+
+  return removed;
+}
 
 static void
 meta_file_copy_into (MetaFile *src,
@@ -739,6 +827,51 @@ stringv_block_end (GString *out,
     g_string_append_c (out, 0);
 }
 
+/* FNV-1a, must never change as it is part of the file format */
+guint32
+meta_builder_hash_name (const char *name)
+{
+  const guchar *p;
+  guint32 hash;
+
+  hash = 2166136261U;
+  for (p = (const guchar *)name; *p != 0; p++)
+    {
+      hash ^= *p;
+      hash *= 16777619U;
+    }
+
+  return hash;
+}
+
+/* Open addressing table of child index + 1, 0 marks a free bucket */
+static void
+write_child_hash (GString *out,
+		  GPtrArray *names)
+{
+  guint32 num_buckets, bucket, i;
+  guint32 *buckets;
+
+  num_buckets = 1;
+  while (num_buckets < names->len * 2)
+    num_buckets <<= 1;
+
+  buckets = g_new0 (guint32, num_buckets);
+  for (i = 0; i < names->len; i++)
+    {
+      bucket = meta_builder_hash_name (g_ptr_array_index (names, i)) & (num_buckets - 1);
+      while (buckets[bucket] != 0)
+	bucket = (bucket + 1) & (num_buckets - 1);
+      buckets[bucket] = i + 1;
+    }
+
+  append_uint32 (out, num_buckets, NULL);
+  for (i = 0; i < num_buckets; i++)
+    append_uint32 (out, buckets[i], NULL);
+
+  g_free (buckets);
+}
+
 static void
 write_children (GString *out,
 		MetaBuilder *builder)
@@ -747,8 +880,11 @@ write_children (GString *out,
   MetaFile *child, *file;
   GSequenceIter *iter;
   GQueue *files;
+  GPtrArray *names;
+  guint32 hash_pointer, num_children_pointer;
 
   files = g_queue_new ();
+  names = g_ptr_array_new ();
 
   g_queue_push_tail (files, builder->root);
 
@@ -760,11 +896,15 @@ write_children (GString *out,
 	continue; /* No children, skip file */
 
       strings = string_block_begin ();
+      g_ptr_array_set_size (names, 0);
+
+      /* Pointer to the child hash, right before the children block */
+      append_uint32 (out, 0, &hash_pointer);
 
       if (file->children_pointer != 0)
 	set_uint32 (out, file->children_pointer, out->len);
 
-      append_uint32 (out, g_sequence_get_length (file->children), NULL);
+      append_uint32 (out, 0, &num_children_pointer);
 
       for (iter = g_sequence_get_begin_iter (file->children);
            iter != g_sequence_get_end_iter (file->children);
@@ -783,14 +923,25 @@ write_children (GString *out,
 	  append_uint32 (out, 0, &child->children_pointer);
 	  append_uint32 (out, 0, &child->metadata_pointer);
 	  append_time_t (out, child->last_changed, builder);
+	  g_ptr_array_add (names, child->name);
 
           if (child->children)
             g_queue_push_tail (files, child);
         }
 
+      /* Skipped children are not counted */
+      set_uint32 (out, num_children_pointer, names->len);
+
       string_block_end (out, strings);
+
+      if (names->len >= CHILD_HASH_MIN_CHILDREN)
+	{
+	  set_uint32 (out, hash_pointer, out->len);
+	  write_child_hash (out, names);
+	}
     }
 
+  g_ptr_array_free (names, TRUE);
   g_queue_free (files);
 }
 
@@ -1029,13 +1180,43 @@ meta_builder_get_journal_filename (const char *tree_filename, guint32 random_tag
   return ret;
 }
 
-gboolean
-meta_builder_create_new_journal (const char *filename, guint32 random_tag)
+/* Size of new journals, can be set in KiB with GVFS_METADATA_JOURNAL_SIZE */
+guint32
+meta_builder_get_default_journal_size (void)
+{
+  static gsize size = 0;
+
+  if (g_once_init_enter (&size))
+    {
+      const char *env;
+      guint64 value;
+
+      value = DEFAULT_JOURNAL_SIZE;
+      env = g_getenv ("GVFS_METADATA_JOURNAL_SIZE");
+      if (env)
+	value = CLAMP (g_ascii_strtoull (env, NULL, 10) * 1024,
+		       MIN_JOURNAL_SIZE, META_BUILDER_MAX_JOURNAL_SIZE);
+
+      g_once_init_leave (&size, value);
+    }
+
+  return size;
+}
+
+/* entries are complete journal entries that the new journal starts with,
+   journal_size is the free space to leave, 0 for the default */
+static gboolean
+create_new_journal_with_entries (const char *filename,
+				 guint32     random_tag,
+				 guint32     journal_size,
+				 const char *entries,
+				 gsize       entries_len,
+				 guint32     num_entries)
 {
   char *journal_name;
   guint32 size_offset;
   GString *out;
-  gsize pos;
+  gsize pos, size;
   gboolean res;
 
   journal_name = meta_builder_get_journal_filename (filename, random_tag);
@@ -1056,11 +1237,18 @@ meta_builder_create_new_journal (const char *filename, guint32 random_tag)
 
   append_uint32 (out, random_tag, NULL);
   append_uint32 (out, 0, &size_offset);
-  append_uint32 (out, 0, NULL); /* Num entries, none so far */
+  append_uint32 (out, num_entries, NULL);
 
+  g_string_append_len (out, entries, entries_len);
   pos = out->len;
 
-  g_string_set_size (out, NEW_JOURNAL_SIZE);
+  if (journal_size == 0)
+    journal_size = meta_builder_get_default_journal_size ();
+
+  size = journal_size;
+  if (pos > size / 2)
+    size = pos + journal_size;
+  g_string_set_size (out, size);
   memset (out->str + pos, 0, out->len - pos);
 
   set_uint32 (out, size_offset, out->len);
@@ -1075,6 +1263,12 @@ meta_builder_create_new_journal (const char *filename, guint32 random_tag)
   return res;
 }
 
+gboolean
+meta_builder_create_new_journal (const char *filename, guint32 random_tag)
+{
+  return create_new_journal_with_entries (filename, random_tag, 0, NULL, 0, 0);
+}
+
 static GString *
 metadata_create_static (MetaBuilder *builder,
 			guint32 *random_tag_out)
@@ -1183,14 +1377,19 @@ metadata_create_static (MetaBuilder *builder,
   return out;
 }
 
+/* Writes the tree to a temporary file next to filename, which can be put
+ * in place with meta_builder_commit(). This is the expensive part of
+ * writing out a tree, and doesn't touch any file that is in use. */
 gboolean
-meta_builder_write (MetaBuilder *builder,
-		    const char *filename)
+meta_builder_write_tmp (MetaBuilder *builder,
+			const char  *filename,
+			char       **tmp_name_out,
+			guint32     *random_tag_out)
 {
   GString *out;
   guint32 random_tag;
-  int fd, fd2, fd_dir;
-  char *tmp_name, *dirname;
+  int fd;
+  char *tmp_name;
 
   out = metadata_create_static (builder, &random_tag);
 
@@ -1200,9 +1399,41 @@ meta_builder_write (MetaBuilder *builder,
     goto out;
 
   if (!write_all_data_and_close (fd, out->str, out->len))
-    goto out;
+    {
+      g_unlink (tmp_name);
+      goto out;
+    }
+
+  g_string_free (out, TRUE);
+  *tmp_name_out = tmp_name;
+  *random_tag_out = random_tag;
+  return TRUE;
 
-  if (!meta_builder_create_new_journal (filename, random_tag))
+ out:
+  g_string_free (out, TRUE);
+  g_free (tmp_name);
+  return FALSE;
+}
+
+/* Replaces filename with the tree written by meta_builder_write_tmp(), and
+ * marks the old tree as rotated. The new journal starts out with
+ * journal_entries, which were added to the old journal after the new tree
+ * was built. */
+gboolean
+meta_builder_commit (const char *filename,
+		     const char *tmp_name,
+		     guint32     random_tag,
+		     guint32     journal_size,
+		     const char *journal_entries,
+		     gsize       journal_entries_len,
+		     guint32     num_journal_entries)
+{
+  int fd2, fd_dir;
+  char *dirname;
+
+  if (!create_new_journal_with_entries (filename, random_tag, journal_size,
+					journal_entries, journal_entries_len,
+					num_journal_entries))
     goto out;
 
   /* Open old file so we can set it rotated */
@@ -1247,14 +1478,27 @@ meta_builder_write (MetaBuilder *builder,
 	}
     }
 
-  g_string_free (out, TRUE);
-  g_free (tmp_name);
   return TRUE;
 
  out:
-  if (fd != -1)
-    g_unlink (tmp_name);
-  g_string_free (out, TRUE);
-  g_free (tmp_name);
+  g_unlink (tmp_name);
   return FALSE;
 }
+
+gboolean
+meta_builder_write (MetaBuilder *builder,
+		    const char *filename)
+{
+  char *tmp_name;
+  guint32 random_tag;
+  gboolean res;
+
+  if (!meta_builder_write_tmp (builder, filename, &tmp_name, &random_tag))
+    return FALSE;
+
+  res = meta_builder_commit (filename, tmp_name, random_tag,
+			     builder->journal_size, NULL, 0, 0);
+  g_free (tmp_name);
+
+  return res;
+}
@@ -29,11 +29,14 @@ typedef struct _MetaBuilder MetaBuilder;
 typedef struct _MetaFile MetaFile;
 typedef struct _MetaData MetaData;
 
+#define META_BUILDER_MAX_JOURNAL_SIZE (4*1024*1024)
+
 struct _MetaBuilder {
   MetaFile *root;
 
   guint32 root_pointer;
   gint64 time_t_base;
+  guint32 journal_size; /* Of the new journal, 0 for the default */
 };
 
 struct _MetaFile {
@@ -53,6 +56,8 @@ struct _MetaData {
   GList *values;
 };
 
+guint32      meta_builder_hash_name (const char  *name);
+
 MetaBuilder *meta_builder_new       (void);
 void         meta_builder_free      (MetaBuilder *builder);
 void         meta_builder_print     (MetaBuilder *builder);
@@ -66,13 +71,28 @@ void         meta_builder_copy      (MetaBuilder *builder,
 				     const char  *source_path,
 				     const char  *dest_path,
 				     guint64      mtime);
+guint        meta_builder_prune     (MetaBuilder *builder,
+				     const char  *fs_root,
+				     gint64       min_last_changed);
 gboolean     meta_builder_write     (MetaBuilder *builder,
 				     const char  *filename);
+gboolean     meta_builder_write_tmp (MetaBuilder *builder,
+				     const char  *filename,
+				     char       **tmp_name_out,
+				     guint32     *random_tag_out);
+gboolean     meta_builder_commit    (const char  *filename,
+				     const char  *tmp_name,
+				     guint32      random_tag,
+				     guint32      journal_size,
+				     const char  *journal_entries,
+				     gsize        journal_entries_len,
+				     guint32      num_journal_entries);
 gboolean     meta_builder_create_new_journal (const char *filename,
 				     guint32      random_tag);
 char *       meta_builder_get_journal_filename (const char *tree_filename,
 				     guint32      random_tag);
 gboolean     meta_builder_is_on_nfs (const char  *filename);
+guint32      meta_builder_get_default_journal_size (void);
 MetaFile *   metafile_new           (const char  *name,
 				     MetaFile    *parent);
 void         metafile_free          (MetaFile    *file);
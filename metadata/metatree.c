@@ -35,7 +35,8 @@
 
 #define KEY_IS_LIST_MASK (1<<31)
 
-static GRWLock metatree_lock;
+/* Journals filling up faster than this get bigger */
+#define JOURNAL_GROW_INTERVAL_USEC (60 * G_USEC_PER_SEC)
 
 typedef enum {
   JOURNAL_OP_SET_KEY,
@@ -112,10 +113,17 @@ typedef struct {
   MetaJournalEntry *last_entry;
 
   gboolean journal_valid; /* True if all entries validated on open */
+
+  /* Offsets of the validated entries, so that looking up a path doesn't
+     need to walk the whole journal */
+  GHashTable *key_index;  /* path => GArray of key entry offsets */
+  GHashTable *path_index; /* path without trailing slashes => GArray of
+                             copy and remove entry offsets */
 } MetaJournal;
 
 struct _MetaTree {
   volatile guint ref_count;
+  GRWLock lock; /* Protects everything below that changes on refresh */
   char *filename;
   gboolean for_write;
   gboolean on_nfs;
@@ -129,11 +137,17 @@ struct _MetaTree {
   gint64 time_t_base;
   MetaFileHeader *header;
   MetaFileDirEnt *root;
+  gboolean has_child_hash; /* Since version 1.1 */
 
   int num_attributes;
   char **attributes;
 
   MetaJournal *journal;
+
+  guint generation; /* Changes whenever the file or journal is reopened */
+
+  guint32 journal_size; /* For the next journal, 0 until first rotation */
+  gint64 last_full_rotation;
 };
 
 /* Unfortunately the journal entries are only aligned to 32 bit boundaries
@@ -165,6 +179,8 @@ static MetaJournal *meta_journal_open          (MetaTree    *tree,
 						guint32      tag);
 static void         meta_journal_free          (MetaJournal *journal);
 static void         meta_journal_validate_more (MetaJournal *journal);
+static gboolean     journal_entry_is_key_type  (MetaJournalEntry *entry);
+static gboolean     journal_entry_is_path_type (MetaJournalEntry *entry);
 
 GVfsMetadata *
 meta_tree_get_metadata_proxy ()
@@ -264,6 +280,8 @@ verify_string (MetaTree *tree, guint32 pos)
 static void
 meta_tree_clear (MetaTree *tree)
 {
+  tree->generation++;
+
   if (tree->journal)
     {
       meta_journal_free (tree->journal);
@@ -487,6 +505,7 @@ meta_tree_init (MetaTree *tree)
         }
     }
 
+  tree->has_child_hash = tree->header->minor >= 1;
   tree->tag = GUINT32_FROM_BE (tree->header->random_tag);
   tree->time_t_base = GINT64_FROM_BE (tree->header->time_t_base);
 
@@ -516,6 +535,7 @@ meta_tree_open (const char *filename,
   g_assert (sizeof (MetaFileDataEnt) == 8);
 
   tree = g_new0 (MetaTree, 1);
+  g_rw_lock_init (&tree->lock);
   tree->ref_count = 1;
   tree->filename = g_strdup (filename);
   tree->for_write = for_write;
@@ -609,6 +629,7 @@ meta_tree_unref (MetaTree *tree)
   if (is_zero)
     {
       meta_tree_clear (tree);
+      g_rw_lock_clear (&tree->lock);
       g_free (tree->filename);
       g_free (tree);
     }
@@ -681,17 +702,17 @@ meta_tree_refresh (MetaTree *tree)
   gboolean needs_refresh;
   gboolean res = TRUE;
 
-  g_rw_lock_reader_lock (&metatree_lock);
+  g_rw_lock_reader_lock (&tree->lock);
   needs_refresh =
     meta_tree_needs_rereading (tree) ||
     meta_tree_has_new_journal_entries (tree);
-  g_rw_lock_reader_unlock (&metatree_lock);
+  g_rw_lock_reader_unlock (&tree->lock);
 
   if (needs_refresh)
     {
-      g_rw_lock_writer_lock (&metatree_lock);
+      g_rw_lock_writer_lock (&tree->lock);
       res = meta_tree_refresh_locked (tree, FALSE);
-      g_rw_lock_writer_unlock (&metatree_lock);
+      g_rw_lock_writer_unlock (&tree->lock);
     }
 
   return res;
@@ -715,6 +736,62 @@ find_dir_element (const void *_key, const void *_dirent)
   return strcmp (key->name, dirent_name);
 }
 
+/* Returns FALSE if the directory has no child hash, otherwise child
+   is set to the named child or NULL if there is none */
+static gboolean
+dir_lookup_child_hashed (MetaTree *tree,
+			 guint32 children,
+			 MetaFileDir *dir,
+			 const char *name,
+			 MetaFileDirEnt **child)
+{
+  guint32 pos, num_buckets, num_children, bucket, index, i;
+  guint32 *hash_pointer, *hash;
+  char *child_name;
+
+  /* The pointer to the hash is stored right before the children block */
+  pos = GUINT32_FROM_BE (children);
+  if (pos < 4)
+    return FALSE;
+
+  hash_pointer = verify_block_pointer (tree, GUINT32_TO_BE (pos - 4), sizeof (guint32));
+  if (hash_pointer == NULL || *hash_pointer == 0)
+    return FALSE;
+
+  hash = verify_array_block (tree, *hash_pointer, sizeof (guint32));
+  if (hash == NULL)
+    return FALSE;
+
+  num_buckets = GUINT32_FROM_BE (hash[0]);
+  if (num_buckets == 0 || (num_buckets & (num_buckets - 1)) != 0)
+    return FALSE;
+
+  num_children = GUINT32_FROM_BE (dir->num_children);
+
+  *child = NULL;
+  bucket = meta_builder_hash_name (name) & (num_buckets - 1);
+  for (i = 0; i < num_buckets; i++)
+    {
+      index = GUINT32_FROM_BE (hash[1 + bucket]);
+      if (index == 0)
+	break;
+
+      if (index <= num_children)
+	{
+	  child_name = verify_string (tree, dir->children[index - 1].name);
+	  if (child_name != NULL && strcmp (child_name, name) == 0)
+	    {
+	      *child = &dir->children[index - 1];
+	      break;
+	    }
+	}
+
+      bucket = (bucket + 1) & (num_buckets - 1);
+    }
+
+  return TRUE;
+}
+
 /* modifies path!!! */
 static MetaFileDirEnt *
 dir_lookup_path (MetaTree *tree,
@@ -746,11 +823,15 @@ dir_lookup_path (MetaTree *tree,
   if (*end_path != 0)
     *end_path++ = 0;
 
-  key.name = path;
-  key.tree = tree;
-  dirent = bsearch (&key, &dir->children[0],
-		    GUINT32_FROM_BE (dir->num_children), sizeof (MetaFileDirEnt),
-		    find_dir_element);
+  if (!tree->has_child_hash ||
+      !dir_lookup_child_hashed (tree, dirent->children, dir, path, &dirent))
+    {
+      key.name = path;
+      key.tree = tree;
+      dirent = bsearch (&key, &dir->children[0],
+			GUINT32_FROM_BE (dir->num_children), sizeof (MetaFileDirEnt),
+			find_dir_element);
+    }
 
   if (dirent == NULL)
     return NULL;
@@ -855,6 +936,8 @@ static void
 meta_journal_free (MetaJournal *journal)
 {
   g_free (journal->filename);
+  g_hash_table_destroy (journal->key_index);
+  g_hash_table_destroy (journal->path_index);
   munmap(journal->data, journal->len);
   close (journal->fd);
   g_free (journal);
@@ -907,6 +990,49 @@ verify_journal_entry (MetaJournal *journal,
   return (MetaJournalEntry *)(journal->data + offset + entry_len);
 }
 
+static void
+meta_journal_index_entry (MetaJournal *journal,
+			  MetaJournalEntry *entry)
+{
+  guint32 offset;
+  GArray *offsets;
+  char *path;
+  gsize len;
+
+  if (journal_entry_is_key_type (entry))
+    {
+      /* Keys point into the mapped journal */
+      offsets = g_hash_table_lookup (journal->key_index, entry->path);
+      if (offsets == NULL)
+	{
+	  offsets = g_array_new (FALSE, FALSE, sizeof (guint32));
+	  g_hash_table_insert (journal->key_index, entry->path, offsets);
+	}
+    }
+  else if (journal_entry_is_path_type (entry))
+    {
+      /* Matched as prefix, see get_prefix_match() */
+      len = strlen (entry->path);
+      while (len > 0 && entry->path[len-1] == '/')
+	len--;
+      path = g_strndup (entry->path, len);
+
+      offsets = g_hash_table_lookup (journal->path_index, path);
+      if (offsets == NULL)
+	{
+	  offsets = g_array_new (FALSE, FALSE, sizeof (guint32));
+	  g_hash_table_insert (journal->path_index, path, offsets);
+	}
+      else
+	g_free (path);
+    }
+  else
+    return;
+
+  offset = (char *)entry - journal->data;
+  g_array_append_val (offsets, offset);
+}
+
 /* Try to validate more entries, call with writer lock */
 static void
 meta_journal_validate_more (MetaJournal *journal)
@@ -932,6 +1058,7 @@ meta_journal_validate_more (MetaJournal *journal)
 	  break;
 	}
 
+      meta_journal_index_entry (journal, entry);
       entry = next_entry;
       i++;
     }
@@ -1099,10 +1226,13 @@ meta_journal_entry_new_unset (guint64 mtime,
 }
 
 
-/* Call with writer lock held */
+/* Call with writer lock held. The entries only become visible to
+   readers once all of them are in place. */
 static gboolean
-meta_journal_add_entry (MetaJournal *journal,
-			GString *entry)
+meta_journal_add_entries (MetaJournal *journal,
+			  const char *entries,
+			  gsize len,
+			  guint32 num_entries)
 {
   char *ptr;
   guint32 offset;
@@ -1112,19 +1242,27 @@ meta_journal_add_entry (MetaJournal *journal,
   ptr = (char *)journal->last_entry;
   offset =  ptr - journal->data;
 
-  /* Does the entry fit? */
-  if (entry->len > journal->len - offset)
+  /* Do the entries fit? */
+  if (len > journal->len - offset)
     return FALSE;
 
-  memcpy (ptr, entry->str, entry->len);
+  memcpy (ptr, entries, len);
 
-  journal->header->num_entries = GUINT_TO_BE (journal->last_entry_num + 1);
+  journal->header->num_entries = GUINT_TO_BE (journal->last_entry_num + num_entries);
   meta_journal_validate_more (journal);
   g_assert (journal->journal_valid);
 
   return TRUE;
 }
 
+/* Call with writer lock held */
+static gboolean
+meta_journal_add_entry (MetaJournal *journal,
+			GString *entry)
+{
+  return meta_journal_add_entries (journal, entry->str, entry->len, 1);
+}
+
 static MetaJournal *
 meta_journal_open (MetaTree *tree, const char *filename, gboolean for_write, guint32 tag)
 {
@@ -1185,6 +1323,10 @@ meta_journal_open (MetaTree *tree, const char *filename, gboolean for_write, gui
   journal->first_entry = (MetaJournalEntry *)(data + sizeof (MetaJournalHeader));
   journal->last_entry = journal->first_entry;
   journal->last_entry_num = 0;
+  journal->key_index = g_hash_table_new_full (g_str_hash, g_str_equal,
+					      NULL, (GDestroyNotify)g_array_unref);
+  journal->path_index = g_hash_table_new_full (g_str_hash, g_str_equal,
+					       g_free, (GDestroyNotify)g_array_unref);
 
   if (memcmp (journal->header->magic, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != 0)
     goto err;
@@ -1278,6 +1420,51 @@ typedef gboolean (*journal_path_callback) (MetaJournal *journal,
 					   char **iter_path,
 					   gpointer user_data);
 
+/* Returns FALSE if the iteration should stop */
+static gboolean
+meta_journal_visit_entry (MetaJournal *journal,
+			  MetaJournalEntry *entry,
+			  journal_key_callback key_callback,
+			  journal_path_callback path_callback,
+			  char **path_copy,
+			  gpointer user_data)
+{
+  char *journal_path, *journal_key, *source_path;
+  char *value;
+  guint64 mtime;
+
+  mtime = GUINT64_FROM_BE (ldq_u (&(entry->mtime)));
+  journal_path = &entry->path[0];
+
+  if (journal_entry_is_key_type (entry) &&
+      key_callback) /* set, setv or unset */
+    {
+      journal_key = get_next_arg (journal_path);
+      value = get_next_arg (journal_key);
+
+      /* Only affects is path is exactly the same */
+      return key_callback (journal, entry->entry_type,
+			   journal_path, mtime, journal_key,
+			   value,
+			   path_copy, user_data);
+    }
+  else if (journal_entry_is_path_type (entry) &&
+	   path_callback) /* copy or remove */
+    {
+      source_path = NULL;
+      if (entry->entry_type == JOURNAL_OP_COPY_PATH)
+	source_path = get_next_arg (journal_path);
+
+      return path_callback (journal, entry->entry_type,
+			    journal_path, mtime, source_path,
+			    path_copy, user_data);
+    }
+  else
+    g_warning ("Unknown journal entry type %d\n", entry->entry_type);
+
+  return TRUE;
+}
+
 static char *
 meta_journal_iterate (MetaJournal *journal,
 		      const char *path,
@@ -1287,10 +1474,7 @@ meta_journal_iterate (MetaJournal *journal,
 {
   MetaJournalEntry *entry;
   guint32 *sizep, size;
-  char *journal_path, *journal_key, *source_path;
-  char *path_copy, *value;
-  gboolean res;
-  guint64 mtime;
+  char *path_copy;
 
   path_copy = g_strdup (path);
 
@@ -1311,44 +1495,104 @@ meta_journal_iterate (MetaJournal *journal,
           break;
         }
 
-      mtime = GUINT64_FROM_BE (ldq_u (&(entry->mtime)));
-      journal_path = &entry->path[0];
-
-      if (journal_entry_is_key_type (entry) &&
-	  key_callback) /* set, setv or unset */
+      if (!meta_journal_visit_entry (journal, entry,
+				     key_callback, path_callback,
+				     &path_copy, user_data))
 	{
-	  journal_key = get_next_arg (journal_path);
-	  value = get_next_arg (journal_key);
+	  g_free (path_copy);
+	  return NULL;
+	}
+    }
 
-	  /* Only affects is path is exactly the same */
-	  res = key_callback (journal, entry->entry_type,
-			      journal_path, mtime, journal_key,
-			      value,
-			      &path_copy, user_data);
-	  if (!res)
+  return path_copy;
+}
+
+/* Returns the last offset in offsets before limit, or 0 if there is none */
+static guint32
+find_entry_before (GArray *offsets,
+		   guint32 limit)
+{
+  guint lo, hi, mid;
+
+  if (offsets == NULL)
+    return 0;
+
+  lo = 0;
+  hi = offsets->len;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (g_array_index (offsets, guint32, mid) < limit)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  return lo > 0 ? g_array_index (offsets, guint32, lo - 1) : 0;
+}
+
+/* Like meta_journal_iterate(), but uses the journal index to only visit the
+   entries that can affect path: key entries for exactly the (possibly
+   remapped) path, and copy or remove entries for it or one of its parents.
+   So key_callback must ignore entries for other paths. */
+static char *
+meta_journal_iterate_path (MetaJournal *journal,
+			   const char *path,
+			   journal_key_callback key_callback,
+			   journal_path_callback path_callback,
+			   gpointer user_data)
+{
+  guint32 limit, offset;
+  char *path_copy, *parent;
+  gsize len;
+
+  path_copy = g_strdup (path);
+
+  if (journal == NULL)
+    return path_copy;
+
+  limit = (char *)journal->last_entry - journal->data;
+  while (TRUE)
+    {
+      offset = 0;
+      if (key_callback)
+	offset = find_entry_before (g_hash_table_lookup (journal->key_index, path_copy),
+				    limit);
+
+      if (path_callback)
+	{
+	  parent = g_strdup (path_copy);
+	  len = strlen (parent);
+	  while (TRUE)
 	    {
-	      g_free (path_copy);
-	      return NULL;
+	      while (len > 0 && parent[len-1] == '/')
+		len--;
+	      parent[len] = 0;
+
+	      offset = MAX (offset,
+			    find_entry_before (g_hash_table_lookup (journal->path_index, parent),
+					       limit));
+	      if (len == 0)
+		break;
+
+	      while (len > 0 && parent[len-1] != '/')
+		len--;
 	    }
+	  g_free (parent);
 	}
-      else if (journal_entry_is_path_type (entry) &&
-	       path_callback) /* copy or remove */
+
+      if (offset == 0)
+	break;
+
+      limit = offset;
+      if (!meta_journal_visit_entry (journal,
+				     (MetaJournalEntry *)(journal->data + offset),
+				     key_callback, path_callback,
+				     &path_copy, user_data))
 	{
-	  source_path = NULL;
-	  if (entry->entry_type == JOURNAL_OP_COPY_PATH)
-	    source_path = get_next_arg (journal_path);
-
-	  res = path_callback (journal, entry->entry_type,
-			       journal_path, mtime, source_path,
-			       &path_copy, user_data);
-	  if (!res)
-	    {
-	      g_free (path_copy);
-	      return NULL;
-	    }
+	  g_free (path_copy);
+	  return NULL;
 	}
-      else
-	g_warning ("Unknown journal entry type %d\n", entry->entry_type);
     }
 
   return path_copy;
@@ -1456,11 +1700,11 @@ meta_journal_reverse_map_path_and_key (MetaJournal *journal,
   char *res_path;
 
   data.key = key;
-  res_path = meta_journal_iterate (journal,
-				   path,
-				   journal_iter_key,
-				   journal_iter_path,
-				   &data);
+  res_path = meta_journal_iterate_path (journal,
+					path,
+					journal_iter_key,
+					journal_iter_path,
+					&data);
   *type = data.type;
   if (mtime)
     *mtime = data.mtime;
@@ -1479,7 +1723,7 @@ meta_tree_lookup_key_type  (MetaTree                         *tree,
   MetaKeyType type;
   gpointer value;
 
-  g_rw_lock_reader_lock (&metatree_lock);
+  g_rw_lock_reader_lock (&tree->lock);
 
   new_path = meta_journal_reverse_map_path_and_key (tree->journal,
 						    path,
@@ -1503,7 +1747,7 @@ meta_tree_lookup_key_type  (MetaTree                         *tree,
     type = META_KEY_TYPE_STRING;
 
  out:
-  g_rw_lock_reader_unlock (&metatree_lock);
+  g_rw_lock_reader_unlock (&tree->lock);
   return type;
 }
 
@@ -1517,7 +1761,7 @@ meta_tree_get_last_changed (MetaTree *tree,
   gpointer value;
   guint64 res, mtime;
 
-  g_rw_lock_reader_lock (&metatree_lock);
+  g_rw_lock_reader_lock (&tree->lock);
 
   new_path = meta_journal_reverse_map_path_and_key (tree->journal,
 						    path,
@@ -1537,7 +1781,7 @@ meta_tree_get_last_changed (MetaTree *tree,
   g_free (new_path);
 
  out:
-  g_rw_lock_reader_unlock (&metatree_lock);
+  g_rw_lock_reader_unlock (&tree->lock);
 
   return res;
 }
@@ -1554,7 +1798,7 @@ meta_tree_lookup_string (MetaTree   *tree,
   char *new_path;
   char *res;
 
-  g_rw_lock_reader_lock (&metatree_lock);
+  g_rw_lock_reader_lock (&tree->lock);
 
   new_path = meta_journal_reverse_map_path_and_key (tree->journal,
 						    path,
@@ -1583,7 +1827,7 @@ meta_tree_lookup_string (MetaTree   *tree,
     res = g_strdup (verify_string (tree, ent->value));
 
  out:
-  g_rw_lock_reader_unlock (&metatree_lock);
+  g_rw_lock_reader_unlock (&tree->lock);
 
   return res;
 }
@@ -1632,7 +1876,7 @@ meta_tree_lookup_stringv   (MetaTree                         *tree,
   char **res;
   guint32 num_strings, i;
 
-  g_rw_lock_reader_lock (&metatree_lock);
+  g_rw_lock_reader_lock (&tree->lock);
 
   new_path = meta_journal_reverse_map_path_and_key (tree->journal,
 						    path,
@@ -1669,7 +1913,7 @@ meta_tree_lookup_stringv   (MetaTree                         *tree,
     }
 
  out:
-  g_rw_lock_reader_unlock (&metatree_lock);
+  g_rw_lock_reader_unlock (&tree->lock);
 
   return res;
 }
@@ -1887,7 +2131,7 @@ meta_tree_enumerate_dir (MetaTree                         *tree,
   MetaFileDir *dir;
   char *res_path;
 
-  g_rw_lock_reader_lock (&metatree_lock);
+  g_rw_lock_reader_lock (&tree->lock);
 
   data.children = children =
     g_hash_table_new_full (g_str_hash,
@@ -1933,7 +2177,7 @@ meta_tree_enumerate_dir (MetaTree                         *tree,
  out:
   g_free (res_path);
   g_hash_table_destroy (children);
-  g_rw_lock_reader_unlock (&metatree_lock);
+  g_rw_lock_reader_unlock (&tree->lock);
 }
 
 typedef struct {
@@ -2127,7 +2371,7 @@ meta_tree_enumerate_keys (MetaTree                         *tree,
   GHashTableIter iter;
   char *res_path;
 
-  g_rw_lock_reader_lock (&metatree_lock);
+  g_rw_lock_reader_lock (&tree->lock);
 
   keydata.keys = keys =
     g_hash_table_new_full (g_str_hash,
@@ -2136,11 +2380,11 @@ meta_tree_enumerate_keys (MetaTree                         *tree,
 			   (GDestroyNotify)key_info_free);
 
 
-  res_path = meta_journal_iterate (tree->journal,
-				   path,
-				   enum_keys_iter_key,
-				   enum_keys_iter_path,
-				   &keydata);
+  res_path = meta_journal_iterate_path (tree->journal,
+					path,
+					enum_keys_iter_key,
+					enum_keys_iter_path,
+					&keydata);
 
   if (res_path != NULL)
     {
@@ -2181,7 +2425,7 @@ meta_tree_enumerate_keys (MetaTree                         *tree,
  out:
   g_free (res_path);
   g_hash_table_destroy (keys);
-  g_rw_lock_reader_unlock (&metatree_lock);
+  g_rw_lock_reader_unlock (&tree->lock);
 }
 
 
@@ -2276,9 +2520,11 @@ copy_tree_to_builder (MetaTree *tree,
     }
 }
 
+/* Applies the journal entries before end */
 static void
 apply_journal_to_builder (MetaTree *tree,
-			  MetaBuilder *builder)
+			  MetaBuilder *builder,
+			  MetaJournalEntry *end)
 {
   MetaJournal *journal;
   MetaJournalEntry *entry;
@@ -2293,7 +2539,7 @@ apply_journal_to_builder (MetaTree *tree,
   journal = tree->journal;
 
   entry = journal->first_entry;
-  while (entry < journal->last_entry)
+  while (entry < end)
     {
       mtime = GUINT64_FROM_BE (ldq_u (&(entry->mtime)));
       journal_path = &entry->path[0];
@@ -2351,7 +2597,7 @@ apply_journal_to_builder (MetaTree *tree,
       entry = (MetaJournalEntry *)((char *)entry + GUINT32_FROM_BE (*(sizep)));
       if (GUINT32_FROM_BE (*(sizep)) < sizeof (MetaJournalEntry) ||
 	  entry < journal->first_entry ||
-	  entry > journal->last_entry)
+	  entry > end)
         {
           /* This shouldn't happen, we found an entry that is shorter than its data */
           /* See https://bugzilla.gnome.org/show_bug.cgi?id=637095 for discussion */
@@ -2362,12 +2608,11 @@ apply_journal_to_builder (MetaTree *tree,
 }
 
 
-/* Needs write lock */
-static gboolean
-meta_tree_flush_locked (MetaTree *tree)
+/* Needs read lock */
+static MetaBuilder *
+meta_tree_create_builder (MetaTree *tree)
 {
   MetaBuilder *builder;
-  gboolean res;
 
   builder = meta_builder_new ();
 
@@ -2383,42 +2628,99 @@ meta_tree_flush_locked (MetaTree *tree)
     }
 
   if (tree->journal)
-    apply_journal_to_builder (tree, builder);
+    apply_journal_to_builder (tree, builder, tree->journal->last_entry);
 
-  res = meta_builder_write (builder,
-			    meta_tree_get_filename (tree));
-  if (res)
+  return builder;
+}
+
+/* Needs write lock, rereads the tree after a new one was written */
+static gboolean
+meta_tree_reload_locked (MetaTree *tree)
+{
+  gboolean res;
+
+  /* Force re-read since we wrote a new file */
+  res = meta_tree_refresh_locked (tree, TRUE);
+
+  if (tree->root == NULL)
     {
-      /* Force re-read since we wrote a new file */
+      /* It shouldn't happen. We failed to write out an updated tree
+       * probably, therefore all the data are lost. Backup the file and
+       * reload the tree to avoid further crashes. */
+      GTimeVal tv;
+      char *timestamp, *backup;
+
+      g_get_current_time (&tv);
+      timestamp = g_time_val_to_iso8601 (&tv);
+      backup = g_strconcat (meta_tree_get_filename (tree), ".backup.",
+			    timestamp, NULL);
+      g_rename (meta_tree_get_filename (tree), backup);
+
+      g_warning ("meta_tree_flush_locked: tree->root == NULL, possible data loss\n"
+		 "corrupted file was moved to: %s\n"
+		 "(please make a comment on https://bugzilla.gnome.org/show_bug.cgi?id=598561 "
+		 "and attach the corrupted file)",
+		 backup);
+
+      g_free (timestamp);
+      g_free (backup);
+
       res = meta_tree_refresh_locked (tree, TRUE);
+      g_assert (res);
+    }
 
-      if (tree->root == NULL)
-	{
-	  /* It shouldn't happen. We failed to write out an updated tree
-	   * probably, therefore all the data are lost. Backup the file and
-	   * reload the tree to avoid further crashes. */
-	  GTimeVal tv;
-	  char *timestamp, *backup;
-
-	  g_get_current_time (&tv);
-	  timestamp = g_time_val_to_iso8601 (&tv);
-	  backup = g_strconcat (meta_tree_get_filename (tree), ".backup.",
-				timestamp, NULL);
-	  g_rename (meta_tree_get_filename (tree), backup);
-
-	  g_warning ("meta_tree_flush_locked: tree->root == NULL, possible data loss\n"
-		     "corrupted file was moved to: %s\n"
-		     "(please make a comment on https://bugzilla.gnome.org/show_bug.cgi?id=598561 "
-		     "and attach the corrupted file)",
-		     backup);
-
-	  g_free (timestamp);
-	  g_free (backup);
-
-	  res = meta_tree_refresh_locked (tree, TRUE);
-	  g_assert (res);
-	}
-  }
+  return res;
+}
+
+/* Needs write lock. Doubles the size of the next journal if the journal
+   fills up too often, and halves it again when mostly unused. */
+static void
+meta_tree_update_journal_size (MetaTree *tree,
+			       gboolean journal_full)
+{
+  guint32 default_size, size, used;
+  gint64 now;
+
+  default_size = meta_builder_get_default_journal_size ();
+  size = tree->journal_size;
+  if (size == 0)
+    size = default_size;
+
+  if (journal_full)
+    {
+      now = g_get_monotonic_time ();
+      if (tree->last_full_rotation != 0 &&
+	  now - tree->last_full_rotation < JOURNAL_GROW_INTERVAL_USEC)
+	size = MIN (size * 2, META_BUILDER_MAX_JOURNAL_SIZE);
+      tree->last_full_rotation = now;
+    }
+  else if (tree->journal)
+    {
+      used = (char *)tree->journal->last_entry - tree->journal->data;
+      if (used < tree->journal->len / 4)
+	size = MAX (size / 2, default_size);
+    }
+
+  tree->journal_size = size;
+}
+
+/* Needs write lock */
+static gboolean
+meta_tree_flush_locked (MetaTree *tree,
+			gboolean journal_full)
+{
+  MetaBuilder *builder;
+  gboolean res;
+
+  meta_tree_update_journal_size (tree, journal_full);
+
+  builder = meta_tree_create_builder (tree);
+  builder->journal_size = tree->journal_size;
+
+  res = meta_builder_write (builder,
+			    meta_tree_get_filename (tree));
+  if (res)
+    res = meta_tree_reload_locked (tree);
 
   meta_builder_free (builder);
 
@@ -2431,9 +2733,248 @@ meta_tree_flush (MetaTree *tree)
 {
   gboolean res;
 
-  g_rw_lock_writer_lock (&metatree_lock);
-  res = meta_tree_flush_locked (tree);
-  g_rw_lock_writer_unlock (&metatree_lock);
+  g_rw_lock_writer_lock (&tree->lock);
+  res = meta_tree_flush_locked (tree, FALSE);
+  g_rw_lock_writer_unlock (&tree->lock);
+  return res;
+}
+
+typedef struct {
+  MetaTree *tree;
+
+  /* For compaction */
+  char *fs_root;
+  gint64 min_last_changed;
+  guint64 reclaimed;
+} FlushData;
+
+static void
+flush_data_free (FlushData *data)
+{
+  meta_tree_unref (data->tree);
+  g_free (data->fs_root);
+  g_free (data);
+}
+
+/* A compaction that raced with another writeout is started over this
+   many times before giving up */
+#define COMPACT_MAX_RETRIES 3
+
+/* Writes a snapshot of the tree and replaces the tree file with it.
+   Sets *outdated if the tree was reopened in the meantime, then nothing
+   was replaced. */
+static gboolean
+flush_snapshot (FlushData *data,
+		gboolean  *outdated)
+{
+  MetaTree *tree = data->tree;
+  MetaBuilder *builder;
+  MetaJournal *journal;
+  guint generation;
+  guint32 journal_offset, journal_num_entries, pending_len;
+  char *tmp_name;
+  guint32 random_tag;
+  gsize old_size;
+  struct stat statbuf;
+  gboolean res;
+
+  *outdated = FALSE;
+  data->reclaimed = 0;
+
+  /* Take a snapshot of the tree and journal. Writers have to wait for
+     this, but not for writing it out. */
+  g_rw_lock_reader_lock (&tree->lock);
+  generation = tree->generation;
+  old_size = tree->len;
+  builder = meta_tree_create_builder (tree);
+  journal_offset = 0;
+  journal_num_entries = 0;
+  if (tree->journal)
+    {
+      journal_offset = (char *)tree->journal->last_entry - tree->journal->data;
+      journal_num_entries = tree->journal->last_entry_num;
+    }
+  g_rw_lock_reader_unlock (&tree->lock);
+
+  if (data->fs_root)
+    meta_builder_prune (builder, data->fs_root, data->min_last_changed);
+
+  res = meta_builder_write_tmp (builder, meta_tree_get_filename (tree),
+				&tmp_name, &random_tag);
+  meta_builder_free (builder);
+  if (!res)
+    return FALSE;
+
+  if (g_stat (tmp_name, &statbuf) == 0 && (gsize)statbuf.st_size < old_size)
+    data->reclaimed = old_size - statbuf.st_size;
+
+  g_rw_lock_writer_lock (&tree->lock);
+  if (tree->generation != generation)
+    {
+      /* The tree was written out in the meantime, that one is newer */
+      g_unlink (tmp_name);
+      data->reclaimed = 0;
+      *outdated = TRUE;
+      res = TRUE;
+    }
+  else
+    {
+      /* Carry over the entries added while writing the snapshot */
+      journal = tree->journal;
+      pending_len = 0;
+      if (journal)
+	pending_len = ((char *)journal->last_entry - journal->data) - journal_offset;
+
+      meta_tree_update_journal_size (tree, FALSE);
+      res = meta_builder_commit (meta_tree_get_filename (tree),
+				 tmp_name, random_tag, tree->journal_size,
+				 journal ? journal->data + journal_offset : NULL,
+				 pending_len,
+				 journal ? journal->last_entry_num - journal_num_entries : 0);
+      if (res)
+	res = meta_tree_reload_locked (tree);
+    }
+  g_rw_lock_writer_unlock (&tree->lock);
+
+  g_free (tmp_name);
+
+  return res;
+}
+
+static void
+flush_thread (GTask        *task,
+	      gpointer      source_object,
+	      gpointer      task_data,
+	      GCancellable *cancellable)
+{
+  FlushData *data = task_data;
+  gboolean outdated;
+  int i;
+
+  for (i = 0; ; i++)
+    {
+      if (!flush_snapshot (data, &outdated))
+	{
+	  g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+				   "Failed to write metadata tree");
+	  return;
+	}
+
+      /* For a plain flush the newer tree is just as good, but it wasn't
+	 pruned, so a compaction has to start over on it */
+      if (!outdated || data->fs_root == NULL)
+	break;
+
+      if (i == COMPACT_MAX_RETRIES)
+	{
+	  g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_BUSY,
+				   "Metadata tree kept changing during compaction");
+	  return;
+	}
+    }
+
+  g_task_return_boolean (task, TRUE);
+}
+
+/* Like meta_tree_flush(), but builds and writes the new tree in a thread.
+   Only the final replacement of the tree needs the write lock. */
+void
+meta_tree_flush_async (MetaTree            *tree,
+		       GAsyncReadyCallback  callback,
+		       gpointer             user_data)
+{
+  GTask *task;
+  FlushData *data;
+
+  data = g_new0 (FlushData, 1);
+  data->tree = meta_tree_ref (tree);
+
+  task = g_task_new (NULL, NULL, callback, user_data);
+  g_task_set_source_tag (task, meta_tree_flush_async);
+  g_task_set_task_data (task, data, (GDestroyNotify)flush_data_free);
+  g_task_run_in_thread (task, flush_thread);
+  g_object_unref (task);
+}
+
+gboolean
+meta_tree_flush_finish (GAsyncResult *result,
+			GError      **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+  g_return_val_if_fail (g_async_result_is_tagged (result, meta_tree_flush_async), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/* Rewrites the tree without the files that don't exist anymore below
+   fs_root, the filesystem directory the tree describes. The data of files
+   last changed before min_last_changed is dropped too, unless it is 0.
+   Like meta_tree_flush_async(), most of the work happens without locks. */
+void
+meta_tree_compact_async (MetaTree            *tree,
+			 const char          *fs_root,
+			 gint64               min_last_changed,
+			 GAsyncReadyCallback  callback,
+			 gpointer             user_data)
+{
+  GTask *task;
+  FlushData *data;
+
+  data = g_new0 (FlushData, 1);
+  data->tree = meta_tree_ref (tree);
+  data->fs_root = g_strdup (fs_root);
+  data->min_last_changed = min_last_changed;
+
+  task = g_task_new (NULL, NULL, callback, user_data);
+  g_task_set_source_tag (task, meta_tree_compact_async);
+  g_task_set_task_data (task, data, (GDestroyNotify)flush_data_free);
+  g_task_run_in_thread (task, flush_thread);
+  g_object_unref (task);
+}
+
+/* reclaimed is set to how much smaller the tree file got */
+gboolean
+meta_tree_compact_finish (GAsyncResult *result,
+			  guint64      *reclaimed,
+			  GError      **error)
+{
+  FlushData *data;
+
+  g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+  g_return_val_if_fail (g_async_result_is_tagged (result, meta_tree_compact_async), FALSE);
+
+  data = g_task_get_task_data (G_TASK (result));
+  if (reclaimed)
+    *reclaimed = data->reclaimed;
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+gboolean
+meta_tree_compact (MetaTree     *tree,
+		   const char   *fs_root,
+		   gint64        min_last_changed,
+		   guint64      *reclaimed,
+		   GError      **error)
+{
+  GTask *task;
+  FlushData *data;
+  gboolean res;
+
+  data = g_new0 (FlushData, 1);
+  data->tree = meta_tree_ref (tree);
+  data->fs_root = g_strdup (fs_root);
+  data->min_last_changed = min_last_changed;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  g_task_set_task_data (task, data, (GDestroyNotify)flush_data_free);
+  g_task_run_in_thread_sync (task, flush_thread);
+
+  if (reclaimed)
+    *reclaimed = data->reclaimed;
+  res = g_task_propagate_boolean (task, error);
+  g_object_unref (task);
+
   return res;
 }
 
@@ -2446,7 +2987,7 @@ meta_tree_unset (MetaTree                         *tree,
   guint64 mtime;
   gboolean res;
 
-  g_rw_lock_writer_lock (&metatree_lock);
+  g_rw_lock_writer_lock (&tree->lock);
 
   if (tree->journal == NULL ||
       !tree->journal->journal_valid)
@@ -2462,7 +3003,7 @@ meta_tree_unset (MetaTree                         *tree,
   res = TRUE;
   if (!meta_journal_add_entry (tree->journal, entry))
     {
-      if (meta_tree_flush_locked (tree))
+      if (meta_tree_flush_locked (tree, TRUE))
         {
 	  if (!meta_journal_add_entry (tree->journal, entry))
 	  {
@@ -2477,7 +3018,7 @@ meta_tree_unset (MetaTree                         *tree,
   g_string_free (entry, TRUE);
 
  out:
-  g_rw_lock_writer_unlock (&metatree_lock);
+  g_rw_lock_writer_unlock (&tree->lock);
   return res;
 }
 
@@ -2491,7 +3032,7 @@ meta_tree_set_string (MetaTree                         *tree,
   guint64 mtime;
   gboolean res;
 
-  g_rw_lock_writer_lock (&metatree_lock);
+  g_rw_lock_writer_lock (&tree->lock);
 
   if (tree->journal == NULL ||
       !tree->journal->journal_valid)
@@ -2507,7 +3048,7 @@ meta_tree_set_string (MetaTree                         *tree,
   res = TRUE;
   if (!meta_journal_add_entry (tree->journal, entry))
     {
-      if (meta_tree_flush_locked (tree))
+      if (meta_tree_flush_locked (tree, TRUE))
         {
 	  if (!meta_journal_add_entry (tree->journal, entry))
 	  {
@@ -2522,7 +3063,7 @@ meta_tree_set_string (MetaTree                         *tree,
   g_string_free (entry, TRUE);
 
  out:
-  g_rw_lock_writer_unlock (&metatree_lock);
+  g_rw_lock_writer_unlock (&tree->lock);
   return res;
 }
 
@@ -2536,7 +3077,7 @@ meta_tree_set_stringv (MetaTree                         *tree,
   guint64 mtime;
   gboolean res;
 
-  g_rw_lock_writer_lock (&metatree_lock);
+  g_rw_lock_writer_lock (&tree->lock);
 
   if (tree->journal == NULL ||
       !tree->journal->journal_valid)
@@ -2552,7 +3093,7 @@ meta_tree_set_stringv (MetaTree                         *tree,
   res = TRUE;
   if (!meta_journal_add_entry (tree->journal, entry))
     {
-      if (meta_tree_flush_locked (tree))
+      if (meta_tree_flush_locked (tree, TRUE))
         {
 	  if (!meta_journal_add_entry (tree->journal, entry))
 	  {
@@ -2567,7 +3108,7 @@ meta_tree_set_stringv (MetaTree                         *tree,
   g_string_free (entry, TRUE);
 
  out:
-  g_rw_lock_writer_unlock (&metatree_lock);
+  g_rw_lock_writer_unlock (&tree->lock);
   return res;
 }
 
@@ -2579,7 +3120,7 @@ meta_tree_remove (MetaTree *tree,
   guint64 mtime;
   gboolean res;
 
-  g_rw_lock_writer_lock (&metatree_lock);
+  g_rw_lock_writer_lock (&tree->lock);
 
   if (tree->journal == NULL ||
       !tree->journal->journal_valid)
@@ -2595,7 +3136,7 @@ meta_tree_remove (MetaTree *tree,
   res = TRUE;
   if (!meta_journal_add_entry (tree->journal, entry))
     {
-      if (meta_tree_flush_locked (tree))
+      if (meta_tree_flush_locked (tree, TRUE))
         {
 	  if (!meta_journal_add_entry (tree->journal, entry))
 	  {
@@ -2610,7 +3151,7 @@ meta_tree_remove (MetaTree *tree,
   g_string_free (entry, TRUE);
 
  out:
-  g_rw_lock_writer_unlock (&metatree_lock);
+  g_rw_lock_writer_unlock (&tree->lock);
   return res;
 }
 
@@ -2623,7 +3164,7 @@ meta_tree_copy (MetaTree                         *tree,
   guint64 mtime;
   gboolean res;
 
-  g_rw_lock_writer_lock (&metatree_lock);
+  g_rw_lock_writer_lock (&tree->lock);
 
   if (tree->journal == NULL ||
       !tree->journal->journal_valid)
@@ -2639,7 +3180,7 @@ meta_tree_copy (MetaTree                         *tree,
   res = TRUE;
   if (!meta_journal_add_entry (tree->journal, entry))
     {
-      if (meta_tree_flush_locked (tree))
+      if (meta_tree_flush_locked (tree, TRUE))
         {
 	  if (!meta_journal_add_entry (tree->journal, entry))
 	  {
@@ -2654,7 +3195,7 @@ meta_tree_copy (MetaTree                         *tree,
   g_string_free (entry, TRUE);
 
  out:
-  g_rw_lock_writer_unlock (&metatree_lock);
+  g_rw_lock_writer_unlock (&tree->lock);
   return res;
 }
 
@@ -2842,6 +3383,167 @@ struct _MetaLookupCache {
   char *last_device_tree;
 };
 
+/* Clients typically create a MetaLookupCache per file, so the results
+ * are also kept in a process wide cache, which lets the files in a
+ * directory share one resolution. It is dropped whenever the mounts
+ * change, and entries expire so that changed symlinks are noticed.
+ */
+#define SHARED_CACHE_MAX_ENTRIES 256
+#define SHARED_CACHE_TIMEOUT_USEC (5 * G_USEC_PER_SEC)
+
+typedef struct {
+  char *expanded;
+  dev_t dev;
+  char *mountpoint; /* NULL if not looked up yet */
+  char *mountpoint_extra_prefix;
+  gint64 stamp;
+} SharedParentEntry;
+
+static GHashTable *shared_parents = NULL; /* parent => SharedParentEntry */
+static GHashTable *shared_devices = NULL; /* dev_t => tree name or NULL */
+static guint shared_mount_generation = 0;
+G_LOCK_DEFINE_STATIC (shared_cache);
+
+static guint get_mount_generation (void);
+
+static void
+shared_parent_entry_free (SharedParentEntry *entry)
+{
+  g_free (entry->expanded);
+  g_free (entry->mountpoint);
+  g_free (entry->mountpoint_extra_prefix);
+  g_free (entry);
+}
+
+/* Call with the shared_cache lock held */
+static void
+shared_cache_validate (guint mount_generation)
+{
+  if (shared_parents == NULL)
+    {
+      shared_parents = g_hash_table_new_full (g_str_hash, g_str_equal,
+					      g_free,
+					      (GDestroyNotify)shared_parent_entry_free);
+      shared_devices = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+					      g_free, g_free);
+    }
+  else if (shared_mount_generation != mount_generation)
+    {
+      g_hash_table_remove_all (shared_parents);
+      g_hash_table_remove_all (shared_devices);
+    }
+
+  shared_mount_generation = mount_generation;
+}
+
+/* Fills in the last_parent data of cache for cache->last_parent */
+static gboolean
+shared_cache_lookup_parent (MetaLookupCache *cache)
+{
+  SharedParentEntry *entry;
+  guint mount_generation;
+  gboolean res;
+
+  mount_generation = get_mount_generation ();
+
+  G_LOCK (shared_cache);
+  shared_cache_validate (mount_generation);
+
+  res = FALSE;
+  entry = g_hash_table_lookup (shared_parents, cache->last_parent);
+  if (entry != NULL &&
+      g_get_monotonic_time () - entry->stamp > SHARED_CACHE_TIMEOUT_USEC)
+    {
+      g_hash_table_remove (shared_parents, cache->last_parent);
+      entry = NULL;
+    }
+
+  if (entry != NULL)
+    {
+      cache->last_parent_expanded = g_strdup (entry->expanded);
+      cache->last_parent_dev = entry->dev;
+      cache->last_parent_mountpoint = g_strdup (entry->mountpoint);
+      cache->last_parent_mountpoint_extra_prefix = g_strdup (entry->mountpoint_extra_prefix);
+      res = TRUE;
+    }
+
+  G_UNLOCK (shared_cache);
+
+  return res;
+}
+
+static void
+shared_cache_store_parent (MetaLookupCache *cache)
+{
+  SharedParentEntry *entry, *old;
+
+  entry = g_new0 (SharedParentEntry, 1);
+  entry->expanded = g_strdup (cache->last_parent_expanded);
+  entry->dev = cache->last_parent_dev;
+  entry->mountpoint = g_strdup (cache->last_parent_mountpoint);
+  entry->mountpoint_extra_prefix = g_strdup (cache->last_parent_mountpoint_extra_prefix);
+  entry->stamp = g_get_monotonic_time ();
+
+  G_LOCK (shared_cache);
+
+  if (shared_parents != NULL)
+    {
+      /* Keep the age of the original resolution */
+      old = g_hash_table_lookup (shared_parents, cache->last_parent);
+      if (old != NULL)
+	entry->stamp = old->stamp;
+      else if (g_hash_table_size (shared_parents) >= SHARED_CACHE_MAX_ENTRIES)
+	g_hash_table_remove_all (shared_parents);
+
+      g_hash_table_insert (shared_parents, g_strdup (cache->last_parent), entry);
+      entry = NULL;
+    }
+
+  G_UNLOCK (shared_cache);
+
+  if (entry)
+    shared_parent_entry_free (entry);
+}
+
+static gboolean
+shared_cache_lookup_device (dev_t device,
+			    char **tree_out)
+{
+  gint64 key;
+  gpointer value;
+  guint mount_generation;
+  gboolean res;
+
+  mount_generation = get_mount_generation ();
+  key = device;
+
+  G_LOCK (shared_cache);
+  shared_cache_validate (mount_generation);
+  res = g_hash_table_lookup_extended (shared_devices, &key, NULL, &value);
+  if (res)
+    *tree_out = g_strdup (value);
+  G_UNLOCK (shared_cache);
+
+  return res;
+}
+
+static void
+shared_cache_store_device (dev_t device,
+			   const char *tree)
+{
+  gint64 *key;
+
+  key = g_new (gint64, 1);
+  *key = device;
+
+  G_LOCK (shared_cache);
+  if (shared_devices != NULL)
+    g_hash_table_insert (shared_devices, key, g_strdup (tree));
+  else
+    g_free (key);
+  G_UNLOCK (shared_cache);
+}
+
 
 static const char *
 get_tree_for_device (MetaLookupCache *cache,
@@ -2853,15 +3555,24 @@ get_tree_for_device (MetaLookupCache *cache,
     {
       GError *error = NULL;
       GVfsMetadata *metadata_proxy;
+      gboolean resolved = FALSE;
+
+      if (shared_cache_lookup_device (device, &res))
+        {
+          cache->last_device = device;
+          g_free (cache->last_device_tree);
+          cache->last_device_tree = res;
+          return res;
+        }
 
       metadata_proxy = meta_tree_get_metadata_proxy ();
       if (metadata_proxy != NULL)
-        gvfs_metadata_call_get_tree_from_device_sync (metadata_proxy,
-                                                      major (device),
-                                                      minor (device),
-                                                      &res,
-                                                      NULL,
-                                                      &error);
+        resolved = gvfs_metadata_call_get_tree_from_device_sync (metadata_proxy,
+                                                                 major (device),
+                                                                 minor (device),
+                                                                 &res,
+                                                                 NULL,
+                                                                 &error);
 
       if (error)
         {
@@ -2872,6 +3583,9 @@ get_tree_for_device (MetaLookupCache *cache,
 
       if (res && res[0] == '\0')
         g_clear_pointer (&res, g_free);
+      /* Don't remember failures, the daemon may just not be up yet */
+      if (resolved)
+        shared_cache_store_device (device, res);
       cache->last_device = device;
       g_free (cache->last_device_tree);
       cache->last_device_tree = res;
@@ -2891,6 +3605,7 @@ typedef struct {
 static gboolean mountinfo_initialized = FALSE;
 static int mountinfo_fd = -1;
 static MountinfoEntry *mountinfo_roots = NULL;
+static guint mountinfo_generation = 0;
 G_LOCK_DEFINE_STATIC (mountinfo);
 
 /* We want to avoid mmap and stat as these are not ideal
@@ -3073,6 +3788,7 @@ update_mountinfo (void)
 	return;
     }
 
+  mountinfo_generation++;
   free_mountinfo ();
   contents = read_contents (mountinfo_fd);
   lseek (mountinfo_fd, SEEK_SET, 0);
@@ -3114,6 +3830,23 @@ find_mountinfo_root_for_mountpoint (const char *mountpoint)
 
 #endif
 
+/* Changes whenever the mounts change */
+static guint
+get_mount_generation (void)
+{
+#ifdef __linux__
+  guint res;
+
+  G_LOCK (mountinfo);
+  update_mountinfo ();
+  res = mountinfo_generation;
+  G_UNLOCK (mountinfo);
+
+  return res;
+#else
+  return 0;
+#endif
+}
 
 static char *
 get_extra_prefix_for_mount (const char *mountpoint)
@@ -3180,6 +3913,11 @@ find_mountpoint_for (MetaLookupCache *cache,
       dir = get_dirname (last);
     }
 
+  /* A mountpoint found for a file mounted on its own isn't valid
+     for its siblings */
+  if (dev == cache->last_parent_dev)
+    shared_cache_store_parent (cache);
+
  out:
   g_free (first_dir);
 
@@ -3300,12 +4038,17 @@ expand_parents (MetaLookupCache *cache,
       g_free (cache->last_parent);
       g_free (cache->last_parent_expanded);
       cache->last_parent = parent;
-      cache->last_parent_expanded = expand_all_symlinks (parent, &parent_dev);
-      cache->last_parent_dev = parent_dev;
       g_free (cache->last_parent_mountpoint);
       cache->last_parent_mountpoint = NULL;
       g_free (cache->last_parent_mountpoint_extra_prefix);
       cache->last_parent_mountpoint_extra_prefix = NULL;
+
+      if (!shared_cache_lookup_parent (cache))
+        {
+          cache->last_parent_expanded = expand_all_symlinks (parent, &parent_dev);
+          cache->last_parent_dev = parent_dev;
+          shared_cache_store_parent (cache);
+        }
    }
   else
     g_free (parent);
@@ -3404,3 +4147,145 @@ meta_lookup_cache_lookup_path (MetaLookupCache *cache,
   g_free (prefix);
   return NULL;
 }
+
+struct _MetaTreeBatch {
+  GString *entries;
+  guint32 num_entries;
+};
+
+MetaTreeBatch *
+meta_tree_batch_new (void)
+{
+  MetaTreeBatch *batch;
+
+  batch = g_new0 (MetaTreeBatch, 1);
+  batch->entries = g_string_new (NULL);
+
+  return batch;
+}
+
+void
+meta_tree_batch_free (MetaTreeBatch *batch)
+{
+  g_string_free (batch->entries, TRUE);
+  g_free (batch);
+}
+
+static void
+meta_tree_batch_append (MetaTreeBatch *batch,
+			GString *entry)
+{
+  g_string_append_len (batch->entries, entry->str, entry->len);
+  batch->num_entries++;
+  g_string_free (entry, TRUE);
+}
+
+void
+meta_tree_batch_unset (MetaTreeBatch *batch,
+		       const char    *path,
+		       const char    *key)
+{
+  meta_tree_batch_append (batch,
+			  meta_journal_entry_new_unset (time (NULL), path, key));
+}
+
+void
+meta_tree_batch_set_string (MetaTreeBatch *batch,
+			    const char    *path,
+			    const char    *key,
+			    const char    *value)
+{
+  meta_tree_batch_append (batch,
+			  meta_journal_entry_new_set (time (NULL), path, key, value));
+}
+
+void
+meta_tree_batch_set_stringv (MetaTreeBatch *batch,
+			     const char    *path,
+			     const char    *key,
+			     char         **value)
+{
+  meta_tree_batch_append (batch,
+			  meta_journal_entry_new_setv (time (NULL), path, key, value));
+}
+
+void
+meta_tree_batch_remove (MetaTreeBatch *batch,
+			const char    *path)
+{
+  meta_tree_batch_append (batch,
+			  meta_journal_entry_new_remove (time (NULL), path));
+}
+
+/* Appends all the operations of the batch to the journal in one go,
+   taking the write lock only once. Readers see either none or all of
+   them, unless the batch is bigger than an empty journal. Such a batch
+   is added entry by entry, flushing whenever the journal is full, so
+   readers may see it partially applied and on failure the entries
+   before the failing one stay applied. */
+gboolean
+meta_tree_apply_batch (MetaTree      *tree,
+		       MetaTreeBatch *batch)
+{
+  const char *ptr, *end;
+  guint32 size;
+  gboolean res;
+
+  if (batch->num_entries == 0)
+    return TRUE;
+
+  g_rw_lock_writer_lock (&tree->lock);
+
+  if (tree->journal == NULL ||
+      !tree->journal->journal_valid)
+    {
+      res = FALSE;
+      goto out;
+    }
+
+  res = TRUE;
+  if (meta_journal_add_entries (tree->journal,
+				batch->entries->str, batch->entries->len,
+				batch->num_entries))
+    goto out;
+
+  if (!meta_tree_flush_locked (tree, TRUE))
+    {
+      res = FALSE;
+      goto out;
+    }
+
+  if (meta_journal_add_entries (tree->journal,
+				batch->entries->str, batch->entries->len,
+				batch->num_entries))
+    goto out;
+
+  /* Doesn't fit even in an empty journal, add the entries one by one.
+     This is no longer atomic, see above. */
+  ptr = batch->entries->str;
+  end = ptr + batch->entries->len;
+  while (ptr < end)
+    {
+      size = GUINT32_FROM_BE (*(guint32 *)ptr);
+
+      if (!meta_journal_add_entries (tree->journal, ptr, size, 1))
+	{
+	  if (!meta_tree_flush_locked (tree, TRUE))
+	    {
+	      res = FALSE;
+	      break;
+	    }
+	  if (!meta_journal_add_entries (tree->journal, ptr, size, 1))
+	    {
+	      g_warning ("meta_tree_apply_batch: entry is bigger then the size of journal\n");
+	      res = FALSE;
+	    }
+	}
+
+      ptr += size;
+    }
+
+ out:
+  g_rw_lock_writer_unlock (&tree->lock);
+  return res;
+}
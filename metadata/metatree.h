@@ -28,6 +28,7 @@
 
 typedef struct _MetaTree MetaTree;
 typedef struct _MetaLookupCache MetaLookupCache;
+typedef struct _MetaTreeBatch MetaTreeBatch;
 
 typedef enum {
   META_KEY_TYPE_NONE,
@@ -89,6 +90,24 @@ void        meta_tree_enumerate_keys   (MetaTree                         *tree,
 					meta_tree_keys_enumerate_callback callback,
 					gpointer                          user_data);
 gboolean    meta_tree_flush            (MetaTree                         *tree);
+void        meta_tree_flush_async      (MetaTree                         *tree,
+					GAsyncReadyCallback               callback,
+					gpointer                          user_data);
+gboolean    meta_tree_flush_finish     (GAsyncResult                     *result,
+					GError                          **error);
+gboolean    meta_tree_compact          (MetaTree                         *tree,
+					const char                       *fs_root,
+					gint64                            min_last_changed,
+					guint64                          *reclaimed,
+					GError                          **error);
+void        meta_tree_compact_async    (MetaTree                         *tree,
+					const char                       *fs_root,
+					gint64                            min_last_changed,
+					GAsyncReadyCallback               callback,
+					gpointer                          user_data);
+gboolean    meta_tree_compact_finish   (GAsyncResult                     *result,
+					guint64                          *reclaimed,
+					GError                          **error);
 gboolean    meta_tree_unset            (MetaTree                         *tree,
 					const char                       *path,
 					const char                       *key);
@@ -106,6 +125,25 @@ gboolean    meta_tree_copy             (MetaTree                         *tree,
 					const char                       *src,
 					const char                       *dest);
 
+/* MetaTreeBatch is not threadsafe */
+MetaTreeBatch *meta_tree_batch_new         (void);
+void           meta_tree_batch_free        (MetaTreeBatch  *batch);
+void           meta_tree_batch_unset       (MetaTreeBatch  *batch,
+					    const char     *path,
+					    const char     *key);
+void           meta_tree_batch_set_string  (MetaTreeBatch  *batch,
+					    const char     *path,
+					    const char     *key,
+					    const char     *value);
+void           meta_tree_batch_set_stringv (MetaTreeBatch  *batch,
+					    const char     *path,
+					    const char     *key,
+					    char          **value);
+void           meta_tree_batch_remove      (MetaTreeBatch  *batch,
+					    const char     *path);
+gboolean       meta_tree_apply_batch       (MetaTree       *tree,
+					    MetaTreeBatch  *batch);
+
 GVfsMetadata *meta_tree_get_metadata_proxy (void);
 
 #endif /* __META_TREE_H__ */
@@ -0,0 +1,181 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Compares metadata_crc32() against the byte-wise loop it replaced, both
+ * for speed and for identical results over all short lengths and
+ * alignments.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <locale.h>
+
+#include <glib.h>
+
+#include "crc32.h"
+
+static gint64 total_bytes = 256 * 1024 * 1024;
+
+static GOptionEntry entries[] =
+{
+  { "bytes", 'b', 0, G_OPTION_ARG_INT64, &total_bytes, "Bytes to checksum per buffer size", "N" },
+  { NULL }
+};
+
+/* Journal entries are small, the larger sizes show the peak rate */
+static const gsize buffer_sizes[] = { 16, 64, 256, 4096, 1024 * 1024 };
+
+static guint32 bytewise_table[256];
+
+static void
+init_bytewise_table (void)
+{
+  guint32 c;
+  int i, k;
+
+  for (i = 0; i < 256; i++)
+    {
+      c = i;
+      for (k = 0; k < 8; k++)
+	c = (c & 1) ? 0xEDB88320UL ^ (c >> 1) : c >> 1;
+      bytewise_table[i] = c;
+    }
+}
+
+/* The loop metadata_crc32() used before slicing-by-8 */
+static guint32
+bytewise_crc32 (const void *ptr, size_t len)
+{
+  guint32 crc = 0xFFFFFFFF;
+  const guint8 *bp = (const guint8 *) ptr;
+
+  while (len-- > 0)
+    crc = bytewise_table[(crc ^ *bp++) & 0xFF] ^ (crc >> 8);
+
+  return crc ^ 0xFFFFFFFF;
+}
+
+static gboolean
+check_results (const guint8 *data)
+{
+  gsize offset, len;
+
+  if (metadata_crc32 ("123456789", 9) != 0xCBF43926)
+    {
+      g_printerr ("Wrong crc for check string\n");
+      return FALSE;
+    }
+
+  for (offset = 0; offset < 8; offset++)
+    for (len = 0; len <= 256; len++)
+      if (metadata_crc32 (data + offset, len) !=
+	  bytewise_crc32 (data + offset, len))
+	{
+	  g_printerr ("Crc mismatch at offset %" G_GSIZE_FORMAT
+		      " length %" G_GSIZE_FORMAT "\n", offset, len);
+	  return FALSE;
+	}
+
+  return TRUE;
+}
+
+static gdouble
+measure (guint32 (*crc_func) (const void *, size_t),
+	 const guint8 *data,
+	 gsize size,
+	 guint32 *result)
+{
+  gint64 start, i, iterations;
+  guint32 crc;
+
+  iterations = MAX (total_bytes / (gint64)size, 1);
+
+  crc = 0;
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++)
+    crc ^= crc_func (data, size);
+  *result = crc;
+
+  return (g_get_monotonic_time () - start) / (gdouble)G_USEC_PER_SEC;
+}
+
+int
+main (int argc, char *argv[])
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  guint8 *data;
+  gsize max_size, i;
+  guint32 old_res, new_res;
+  gdouble old_secs, new_secs, mb;
+  gint res;
+
+  setlocale (LC_ALL, "");
+
+  context = g_option_context_new ("- benchmark the metadata journal crc");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("option parsing failed: %s\n", error->message);
+      return 1;
+    }
+  g_option_context_free (context);
+
+  if (total_bytes <= 0)
+    {
+      g_printerr ("Number of bytes must be positive\n");
+      return 1;
+    }
+
+  init_bytewise_table ();
+
+  max_size = buffer_sizes[G_N_ELEMENTS (buffer_sizes) - 1];
+  data = g_malloc (max_size + 8);
+  for (i = 0; i < max_size + 8; i++)
+    data[i] = g_random_int () & 0xFF;
+
+  if (!check_results (data))
+    {
+      g_free (data);
+      return 1;
+    }
+
+  res = 0;
+  g_print ("%-10s %14s %14s %8s\n", "size", "bytewise MB/s", "current MB/s", "speedup");
+  for (i = 0; i < G_N_ELEMENTS (buffer_sizes); i++)
+    {
+      old_secs = measure (bytewise_crc32, data, buffer_sizes[i], &old_res);
+      new_secs = measure (metadata_crc32, data, buffer_sizes[i], &new_res);
+
+      if (old_res != new_res)
+	{
+	  g_printerr ("Crc mismatch for size %" G_GSIZE_FORMAT "\n", buffer_sizes[i]);
+	  res = 1;
+	}
+
+      mb = (MAX (total_bytes / (gint64)buffer_sizes[i], 1) * buffer_sizes[i]) / (1024.0 * 1024.0);
+      g_print ("%-10" G_GSIZE_FORMAT " %14.1f %14.1f %7.2fx\n",
+	       buffer_sizes[i], mb / old_secs, mb / new_secs, old_secs / new_secs);
+    }
+
+  g_free (data);
+
+  return res;
+}
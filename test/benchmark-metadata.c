@@ -0,0 +1,338 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Measures the metadata store without the daemon: writing a synthetic
+ * tree, looking up keys, enumerating directories, replaying the journal
+ * and rewriting the tree.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <locale.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "metatree.h"
+#include "metabuilder.h"
+
+static gint num_files = 100000;
+static gint files_per_dir = 100;
+static gint num_lookups = 100000;
+static gint num_journal_ops = 10000;
+static gchar *scratch_dir = NULL;
+
+static GOptionEntry entries[] =
+{
+  { "files", 'n', 0, G_OPTION_ARG_INT, &num_files, "Number of files in the tree", "N" },
+  { "files-per-dir", 'f', 0, G_OPTION_ARG_INT, &files_per_dir, "Number of files per directory", "N" },
+  { "lookups", 'l', 0, G_OPTION_ARG_INT, &num_lookups, "Number of lookups", "N" },
+  { "journal-ops", 'j', 0, G_OPTION_ARG_INT, &num_journal_ops, "Number of journal writes", "N" },
+  { "dir", 'd', 0, G_OPTION_ARG_FILENAME, &scratch_dir, "Scratch directory", "DIR" },
+  { NULL }
+};
+
+/* Files are spread over two levels of directories */
+static char *
+get_path (gint i)
+{
+  gint dir;
+
+  dir = i / files_per_dir;
+  return g_strdup_printf ("/dir%d/dir%d/file%d",
+			  dir / files_per_dir, dir % files_per_dir, i);
+}
+
+static char *
+get_dir_path (gint dir)
+{
+  return g_strdup_printf ("/dir%d/dir%d",
+			  dir / files_per_dir, dir % files_per_dir);
+}
+
+static gint64
+get_peak_rss_kb (void)
+{
+  char *contents, *line;
+  gint64 res;
+
+  res = -1;
+  if (g_file_get_contents ("/proc/self/status", &contents, NULL, NULL))
+    {
+      line = strstr (contents, "VmHWM:");
+      if (line)
+	res = g_ascii_strtoll (line + strlen ("VmHWM:"), NULL, 10);
+      g_free (contents);
+    }
+
+  return res;
+}
+
+static void
+report (const char *name, gint64 start, gint num_ops)
+{
+  gdouble secs;
+
+  secs = (g_get_monotonic_time () - start) / (gdouble)G_USEC_PER_SEC;
+  if (num_ops > 0)
+    g_print ("%-20s %10.3f s %12.0f ops/s\n", name, secs, num_ops / secs);
+  else
+    g_print ("%-20s %10.3f s\n", name, secs);
+}
+
+static gboolean
+write_tree (const char *filename)
+{
+  MetaBuilder *builder;
+  MetaFile *file;
+  char *path, *value;
+  gint64 start;
+  gboolean res;
+  gint i;
+
+  start = g_get_monotonic_time ();
+
+  builder = meta_builder_new ();
+  for (i = 0; i < num_files; i++)
+    {
+      path = get_path (i);
+      file = meta_builder_lookup (builder, path, TRUE);
+      metafile_set_mtime (file, 1000000000 + i);
+      value = g_strdup_printf ("%d", i);
+      metafile_key_set_value (file, "metadata::position", value);
+      metafile_key_set_value (file, "metadata::emblems", "important");
+      g_free (value);
+      g_free (path);
+    }
+  report ("build", start, num_files);
+
+  start = g_get_monotonic_time ();
+  res = meta_builder_write (builder, filename);
+  report ("write", start, 0);
+
+  meta_builder_free (builder);
+
+  return res;
+}
+
+static void
+lookup_keys (MetaTree *tree, const char *name)
+{
+  char *path, *value;
+  gint64 start;
+  gint i, misses;
+
+  misses = 0;
+  start = g_get_monotonic_time ();
+  for (i = 0; i < num_lookups; i++)
+    {
+      path = get_path (g_random_int_range (0, num_files));
+      value = meta_tree_lookup_string (tree, path, "metadata::position");
+      if (value == NULL)
+	misses++;
+      g_free (value);
+      g_free (path);
+    }
+  report (name, start, num_lookups);
+
+  if (misses > 0)
+    g_printerr ("%d lookups failed\n", misses);
+}
+
+static gboolean
+count_entry (const char *entry,
+	     guint64 last_changed,
+	     gboolean has_children,
+	     gboolean has_data,
+	     gpointer user_data)
+{
+  (*(gint *)user_data)++;
+  return TRUE;
+}
+
+static void
+enumerate_dirs (MetaTree *tree)
+{
+  char *path;
+  gint64 start;
+  gint dir, num_dirs, count;
+
+  num_dirs = (num_files + files_per_dir - 1) / files_per_dir;
+  count = 0;
+
+  start = g_get_monotonic_time ();
+  for (dir = 0; dir < num_dirs; dir++)
+    {
+      path = get_dir_path (dir);
+      meta_tree_enumerate_dir (tree, path, count_entry, &count);
+      g_free (path);
+    }
+  report ("enumerate", start, count);
+}
+
+static void
+write_journal (MetaTree *tree)
+{
+  char *path, *value;
+  gint64 start;
+  gint i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < num_journal_ops; i++)
+    {
+      path = get_path (g_random_int_range (0, num_files));
+      value = g_strdup_printf ("%d", -i);
+      if (!meta_tree_set_string (tree, path, "metadata::position", value))
+	g_printerr ("Failed to set %s\n", path);
+      g_free (value);
+      g_free (path);
+    }
+  report ("journal write", start, num_journal_ops);
+}
+
+static gint
+benchmark_run (const char *dir)
+{
+  MetaTree *tree, *reader;
+  char *filename;
+  gint64 start;
+
+  filename = g_build_filename (dir, "benchmark-tree", NULL);
+
+  if (!write_tree (filename))
+    {
+      g_printerr ("Failed to write %s\n", filename);
+      g_free (filename);
+      return 1;
+    }
+
+  start = g_get_monotonic_time ();
+  tree = meta_tree_open (filename, TRUE);
+  report ("open", start, 0);
+  if (tree == NULL)
+    {
+      g_printerr ("Failed to open %s\n", filename);
+      g_free (filename);
+      return 1;
+    }
+
+  lookup_keys (tree, "lookup");
+  enumerate_dirs (tree);
+
+  /* Rotates the journal whenever it is full */
+  write_journal (tree);
+
+  /* A fresh reader has to validate and index the whole journal */
+  start = g_get_monotonic_time ();
+  reader = meta_tree_open (filename, FALSE);
+  report ("journal replay", start, 0);
+  if (reader)
+    {
+      lookup_keys (reader, "lookup w/ journal");
+      meta_tree_unref (reader);
+    }
+
+  start = g_get_monotonic_time ();
+  if (!meta_tree_flush (tree))
+    g_printerr ("Failed to flush %s\n", filename);
+  report ("flush", start, 0);
+
+  lookup_keys (tree, "lookup after flush");
+
+  meta_tree_unref (tree);
+
+  g_print ("%-20s %10" G_GINT64_FORMAT " kB\n", "peak rss", get_peak_rss_kb ());
+
+  g_free (filename);
+
+  return 0;
+}
+
+static void
+remove_scratch_files (const char *dir)
+{
+  GDir *d;
+  const char *name;
+  char *path;
+
+  d = g_dir_open (dir, 0, NULL);
+  if (d == NULL)
+    return;
+
+  while ((name = g_dir_read_name (d)) != NULL)
+    {
+      if (g_str_has_prefix (name, "benchmark-tree"))
+	{
+	  path = g_build_filename (dir, name, NULL);
+	  g_unlink (path);
+	  g_free (path);
+	}
+    }
+
+  g_dir_close (d);
+}
+
+int
+main (int argc, char *argv[])
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  char *dir;
+  gint res;
+
+  setlocale (LC_ALL, "");
+
+  context = g_option_context_new ("- benchmark the metadata store");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("option parsing failed: %s\n", error->message);
+      return 1;
+    }
+  g_option_context_free (context);
+
+  if (num_files <= 0 || files_per_dir <= 0)
+    {
+      g_printerr ("Number of files must be positive\n");
+      return 1;
+    }
+
+  if (scratch_dir)
+    dir = g_strdup (scratch_dir);
+  else
+    {
+      dir = g_dir_make_tmp ("gvfs-benchmark-metadata-XXXXXX", &error);
+      if (dir == NULL)
+	{
+	  g_printerr ("Failed to create scratch dir: %s\n", error->message);
+	  return 1;
+	}
+    }
+
+  res = benchmark_run (dir);
+
+  remove_scratch_files (dir);
+  if (scratch_dir == NULL)
+    g_rmdir (dir);
+  g_free (dir);
+
+  return res;
+}